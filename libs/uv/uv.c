@@ -26,6 +26,7 @@ typedef struct sockaddr uv_sockaddr;
 typedef struct {
 	vclosure *events[EVT_MAX + 1];
 	void *write_data;
+	int root;
 } events_data;
 
 #define UV_DATA(h)		((events_data*)((h)->data))
@@ -40,7 +41,7 @@ typedef struct {
 static events_data *init_hl_data( uv_handle_t *h ) {
 	events_data *d = hl_gc_alloc_raw(sizeof(events_data));
 	memset(d,0,sizeof(events_data));
-	hl_add_root(&h->data);
+	d->root = hl_add_root(&h->data);
 	h->data = d;
 	return d;
 }
@@ -67,7 +68,7 @@ static void on_close( uv_handle_t *h ) {
 	if( !ev ) return;
 	trigger_callb(h, EVT_CLOSE, NULL, 0, false);
 	free(ev->write_data);
-	hl_remove_root(&h->data);
+	hl_remove_root_handle(ev->root);
 	h->data = NULL;
 	free(h);
 }
@@ -5,6 +5,7 @@ typedef Target = {
 	var args : Array<String>;
 	@:optional var extraArgs : String;
 	@:optional var startup : Float;
+	@:optional var env : String;
 }
 
 class Benchs {
@@ -39,6 +40,7 @@ class Benchs {
 		var args = Sys.args();
 		var is32 = false;
 		var checkFlash = false;
+		var checkGC = false;
 		
 		while( args.length > 0 ) {
 			switch( args[0] ) {
@@ -46,6 +48,9 @@ class Benchs {
 				is32 = true;
 			case "-swf":
 				checkFlash = true;
+			case "-gc":
+				// compare HL mark times with and without huge pages
+				checkGC = true;
 			default:
 				break;
 			}
@@ -60,6 +65,13 @@ class Benchs {
 			{ name : "neko", out : "bench.n", cmd : "neko", args : ["bench.n"] },
 			{ name : "cpp", out : "cpp", cmd : "cpp/$name" + (isWin ? ".exe" : ""), args : [], extraArgs : "-D HXCPP_SILENT -D HXCPP_GC_GENERATIONAL" },
 		];
+		if( checkGC ) {
+			Sys.putEnv("HL_GC_PROFILE", "1");
+			targets = [
+				{ name : "hl", out : "bench.hl", cmd : "hl", args : ["bench.hl"], env : "HL_GC_HUGEPAGES=0" },
+				{ name : "hl-thp", out : "bench.hl", cmd : "hl", args : ["bench.hl"], env : "HL_GC_HUGEPAGES=1" },
+			];
+		}
 		if( checkFlash )
 			targets.push({ name : "swf", out : "bench.swf", cmd : "adl", args : ["bench.air"], extraArgs : "-lib air3" });
 
@@ -108,7 +120,7 @@ class Benchs {
 
 				Sys.print("\t" + t.name+"...\r");
 
-				var hargs = ["-" + (t.name == "hlc" ? "hl" : t.name), t.out, "-main", name, "-dce", "full"];
+				var hargs = ["-" + (StringTools.startsWith(t.name, "hl") ? "hl" : t.name), t.out, "-main", name, "-dce", "full"];
 				if( t.extraArgs != null )
 					for( a in t.extraArgs.split(" ") )
 						hargs.push(a);
@@ -133,9 +145,14 @@ class Benchs {
 					}
 				}
 
+				if( t.env != null ) {
+					var kv = t.env.split("=");
+					Sys.putEnv(kv[0], kv[1]);
+				}
+
 				function run() {
 
-					var totT = 0., count = 0;
+					var totT = 0., count = 0, totMark = 0., totRate = 0.;
 					var r = null;
 
 					var firstRun = true;
@@ -154,6 +171,25 @@ class Benchs {
 							r = StringTools.trim(bytes.sub(4,bytes.length-4).toString());
 						} else
 							r = StringTools.trim(p.stdout.readAll().toString());
+						var mark = 0., rate = 0., marks = 0;
+						if( checkGC ) {
+							// strip the GC profile report, keep the total mark time
+							var lines = [];
+							for( l in r.split("\n") ) {
+								if( StringTools.startsWith(l, "GC-PROFILE") ) continue;
+								if( StringTools.startsWith(l, "\t") ) {
+									var kv = StringTools.trim(l).split(" ");
+									if( kv[0] == "total-mark-time" ) mark = Std.parseFloat(kv[1]);
+									if( kv[0] == "mark-rate" ) {
+										rate += Std.parseFloat(kv[1]);
+										marks++;
+									}
+									continue;
+								}
+								lines.push(l);
+							}
+							r = StringTools.trim(lines.join("\n"));
+						}
 						if( r != result ) {
 							Sys.println(t.name+" result "+r+" but expected "+result);
 							return;
@@ -162,6 +198,8 @@ class Benchs {
 							firstRun = false;
 						else {
 							totT += et;
+							totMark += mark;
+							if( marks > 0 ) totRate += rate / marks;
 							count++;
 						}
 					}
@@ -172,7 +210,7 @@ class Benchs {
 					else
 						et -= t.startup;
 
-					Sys.println("\t" + StringTools.rpad(t.name," ",5) + Std.int(et*100)/100);
+					Sys.println("\t" + StringTools.rpad(t.name," ",5) + Std.int(et*100)/100 + (checkGC ? "\tmark " + Std.int(totMark/count*100)/100 + "\t" + Std.int(totRate/count) + "M words/s" : ""));
 				}
 				run();
 			}
@@ -0,0 +1,48 @@
+
+class MarkNode {
+	public var left : MarkNode;
+	public var right : MarkNode;
+	public var items : Array<MarkNode>;
+	public var value : Int;
+	public function new(value) {
+		this.value = value;
+	}
+}
+
+/**
+	Keeps a large graph alive and runs major collections over it : the time is spent marking.
+	Run with HL_GC_PROFILE=1 (or Benchs -gc) to get the words scanned per second.
+**/
+@:result(2097151)
+class GcMark {
+
+	static function make( depth : Int, value : Int ) {
+		var n = new MarkNode(value);
+		if( depth > 0 ) {
+			n.left = make(depth - 1, value * 2);
+			n.right = make(depth - 1, value * 2 + 1);
+			if( (depth & 3) == 0 ) n.items = [n.left, n.right, n.left.left, n.right.right];
+		}
+		return n;
+	}
+
+	static function count( n : MarkNode ) : Int {
+		if( n == null ) return 0;
+		return 1 + count(n.left) + count(n.right);
+	}
+
+	public static function main() {
+		var root = make(20, 1);
+		for( i in 0...20 ) {
+			#if hl
+			hl.Gc.major();
+			#elseif cpp
+			cpp.vm.Gc.run(true);
+			#elseif neko
+			neko.vm.Gc.run(true);
+			#end
+		}
+		Benchs.result(count(root));
+	}
+
+}
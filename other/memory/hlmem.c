@@ -0,0 +1,610 @@
+/*
+ * Copyright (C)2015-2016 Haxe Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+// reads the heap snapshots written by hl_gc_snapshot (see the format in alloc.c),
+// computes the retained sizes with the dominator tree and diffs two snapshots
+#include <hl.h>
+
+typedef struct {
+	char *name;
+	int kind;
+} snap_type;
+
+typedef struct {
+	const char *file;
+	unsigned char *data;
+	int64 size;
+	int wsize;
+	int count; // nodes, the first one is the root of the graph
+	int ntypes;
+	int nroots; // successors of the root, including the unreachable blocks
+	int unreached;
+	int64 nrefs;
+	int64 bytes;
+	snap_type *types;
+	uint64 *addr;
+	int64 *size_of;
+	int *type;
+	unsigned char *page_kind;
+	int64 *ref_start;
+	int *refs;
+	int *roots;
+	int *idom;
+	int64 *retained;
+} snapshot;
+
+typedef struct {
+	char *key;
+	int64 count;
+	int64 bytes;
+	int64 retained;
+	int64 old_count;
+	int64 old_bytes;
+} stat_entry;
+
+typedef struct {
+	stat_entry *entries;
+	int size;
+	int count;
+} stat_table;
+
+static int max_lines = 20;
+static int max_depth = 4;
+
+static void fatal( const char *msg, const char *file ) {
+	fprintf(stderr, "%s: %s\n", file, msg);
+	exit(1);
+}
+
+static void *alloc( int64 size ) {
+	void *p = calloc(1, (size_t)(size ? size : 1));
+	if( p == NULL ) fatal("out of memory", "hlmem");
+	return p;
+}
+
+// -------------------------  LOADING ----------------------------------------------------------
+
+static uint64 read_u( snapshot *s, int64 *pos ) {
+	uint64 v = 0;
+	int shift = 0;
+	while( true ) {
+		int b;
+		if( *pos >= s->size ) fatal("truncated snapshot", s->file);
+		b = s->data[(*pos)++];
+		v |= (uint64)(b & 0x7F) << shift;
+		if( (b & 0x80) == 0 ) break;
+		shift += 7;
+	}
+	return v;
+}
+
+static int64 read_s( snapshot *s, int64 *pos ) {
+	uint64 v = read_u(s, pos);
+	return (int64)(v >> 1) ^ -(int64)(v & 1);
+}
+
+static int cmp_addr_data( const void *a, const void *b ) {
+	uint64 x = ((uint64*)a)[0], y = ((uint64*)b)[0];
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// returns the node at this address or 0
+static int find_node( uint64 *sorted, int count, uint64 addr ) {
+	int min = 0, max = count;
+	while( min < max ) {
+		int mid = (min + max) >> 1;
+		uint64 a = sorted[mid << 1];
+		if( a == addr ) return (int)sorted[(mid << 1) + 1];
+		if( a < addr ) min = mid + 1; else max = mid;
+	}
+	return 0;
+}
+
+static void load( snapshot *s, const char *file ) {
+	FILE *f = fopen(file, "rb");
+	int64 pos, index = 0, nrefs = 0;
+	int64 ref;
+	uint64 *targets, *sorted, *root_addr;
+	uint64 prev = 0;
+	int i, node = 0, page_kind = 0, nroots = 0, npages;
+	memset(s, 0, sizeof(snapshot));
+	s->file = file;
+	if( f == NULL ) fatal("can't open file", file);
+	fseek(f, 0, SEEK_END);
+	s->size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	s->data = (unsigned char*)alloc(s->size);
+	if( fread(s->data, 1, (size_t)s->size, f) != (size_t)s->size ) fatal("can't read file", file);
+	fclose(f);
+	if( s->size < 13 || memcmp(s->data, "HMS1", 4) != 0 ) fatal("not a heap snapshot", file);
+	s->wsize = s->data[4];
+	for(i=0;i<8;i++)
+		index |= (int64)s->data[s->size - 8 + i] << (i * 8);
+	if( index < 5 || index >= s->size - 8 || s->data[index] != 'X' ) fatal("invalid snapshot index", file);
+	pos = index + 1;
+	s->count = (int)read_u(s, &pos) + 1;
+	s->nrefs = (int64)read_u(s, &pos);
+	s->ntypes = (int)read_u(s, &pos) + 1;
+	nroots = (int)read_u(s, &pos);
+	s->bytes = (int64)read_u(s, &pos);
+	npages = (int)read_u(s, &pos);
+	(void)npages;
+
+	s->types = (snap_type*)alloc(sizeof(snap_type) * s->ntypes);
+	s->addr = (uint64*)alloc(sizeof(uint64) * s->count);
+	s->size_of = (int64*)alloc(sizeof(int64) * s->count);
+	s->type = (int*)alloc(sizeof(int) * s->count);
+	s->page_kind = (unsigned char*)alloc(s->count);
+	s->ref_start = (int64*)alloc(sizeof(int64) * (s->count + 1));
+	targets = (uint64*)alloc(sizeof(uint64) * s->nrefs);
+	root_addr = (uint64*)alloc(sizeof(uint64) * nroots);
+	nroots = 0;
+
+	pos = 5;
+	while( pos < index ) {
+		switch( s->data[pos++] ) {
+		case 'T':
+			{
+				int id = (int)read_u(s, &pos);
+				int kind = (int)read_u(s, &pos);
+				int len = (int)read_u(s, &pos);
+				if( id <= 0 || id >= s->ntypes || pos + len > index ) fatal("invalid type", file);
+				s->types[id].kind = kind;
+				if( len ) {
+					s->types[id].name = (char*)alloc(len + 1);
+					memcpy(s->types[id].name, s->data + pos, len);
+				}
+				pos += len;
+			}
+			break;
+		case 'P':
+			prev = read_u(s, &pos);
+			page_kind = (int)read_u(s, &pos);
+			break;
+		case 'B':
+			{
+				int n;
+				if( ++node >= s->count ) fatal("too many blocks", file);
+				prev += read_u(s, &pos);
+				s->addr[node] = prev;
+				s->size_of[node] = (int64)read_u(s, &pos) * s->wsize;
+				s->type[node] = (int)read_u(s, &pos);
+				s->page_kind[node] = (unsigned char)page_kind;
+				if( s->type[node] >= s->ntypes ) fatal("invalid block type", file);
+				n = (int)read_u(s, &pos);
+				s->ref_start[node] = nrefs;
+				if( nrefs + n > s->nrefs ) fatal("too many references", file);
+				while( n-- > 0 )
+					targets[nrefs++] = prev + read_s(s, &pos);
+			}
+			break;
+		case 'R':
+			read_u(s, &pos); // kind
+			read_u(s, &pos); // thread
+			root_addr[nroots++] = read_u(s, &pos);
+			break;
+		default:
+			fatal("invalid record", file);
+		}
+	}
+	if( node != s->count - 1 ) fatal("missing blocks", file);
+	s->ref_start[0] = 0;
+	s->ref_start[s->count] = nrefs;
+	s->nrefs = nrefs;
+
+	// resolve the addresses
+	sorted = (uint64*)alloc(sizeof(uint64) * 2 * s->count);
+	for(i=1;i<s->count;i++) {
+		sorted[(i - 1) << 1] = s->addr[i];
+		sorted[((i - 1) << 1) + 1] = i;
+	}
+	qsort(sorted, s->count - 1, sizeof(uint64) * 2, cmp_addr_data);
+	s->refs = (int*)alloc(sizeof(int) * nrefs);
+	for(ref=0;ref<nrefs;ref++)
+		s->refs[ref] = find_node(sorted, s->count - 1, targets[ref]);
+	// the unreachable blocks will be added after the roots
+	s->roots = (int*)alloc(sizeof(int) * (nroots + s->count));
+	for(i=0;i<nroots;i++) {
+		int n = find_node(sorted, s->count - 1, root_addr[i]);
+		if( n ) s->roots[s->nroots++] = n;
+	}
+	free(sorted);
+	free(targets);
+	free(root_addr);
+}
+
+// -------------------------  DOMINATORS ----------------------------------------------------------
+
+#define SUCC_START(s,v)		((v) ? (s)->ref_start[v] : 0)
+#define SUCC_END(s,v)		((v) ? (s)->ref_start[(v)+1] : (s)->nroots)
+#define SUCC(s,v,i)			((v) ? (s)->refs[i] : (s)->roots[i])
+
+// iterative depth first numbering from the root, returns the number of visited nodes
+static int dfs( snapshot *s, int start, int num, int *dfnum, int *vertex, int *parent, int *stack, int64 *next ) {
+	int sp = 0;
+	dfnum[start] = num;
+	vertex[num++] = start;
+	stack[sp] = start;
+	next[sp++] = SUCC_START(s, start);
+	while( sp > 0 ) {
+		int v = stack[sp - 1];
+		if( next[sp - 1] == SUCC_END(s, v) ) {
+			sp--;
+			continue;
+		}
+		int w = SUCC(s, v, next[sp - 1]++);
+		if( w == 0 || dfnum[w] >= 0 ) continue;
+		dfnum[w] = num;
+		vertex[num++] = w;
+		parent[w] = v;
+		stack[sp] = w;
+		next[sp++] = SUCC_START(s, w);
+	}
+	return num;
+}
+
+static int eval( int v, int *ancestor, int *label, int *semi, int *stack ) {
+	int sp = 0, x = v;
+	if( ancestor[v] < 0 ) return v;
+	// path compression
+	while( ancestor[ancestor[x]] >= 0 ) {
+		stack[sp++] = x;
+		x = ancestor[x];
+	}
+	while( sp > 0 ) {
+		int a;
+		x = stack[--sp];
+		a = ancestor[x];
+		if( semi[label[a]] < semi[label[x]] ) label[x] = label[a];
+		ancestor[x] = ancestor[a];
+	}
+	return label[v];
+}
+
+// Lengauer-Tarjan, then the retained size of each node is its size plus the ones it dominates
+static void dominators( snapshot *s ) {
+	int n = s->count;
+	int *dfnum = (int*)alloc(sizeof(int) * n);
+	int *vertex = (int*)alloc(sizeof(int) * n);
+	int *parent = (int*)alloc(sizeof(int) * n);
+	int *semi = (int*)alloc(sizeof(int) * n);
+	int *ancestor = (int*)alloc(sizeof(int) * n);
+	int *label = (int*)alloc(sizeof(int) * n);
+	int *bucket = (int*)alloc(sizeof(int) * n);
+	int *bucket_next = (int*)alloc(sizeof(int) * n);
+	int *stack = (int*)alloc(sizeof(int) * n);
+	int64 *next = (int64*)alloc(sizeof(int64) * n);
+	int64 *pred_start = (int64*)alloc(sizeof(int64) * (n + 1));
+	int *preds;
+	int i, v, num;
+	int64 e;
+	for(i=0;i<n;i++) {
+		dfnum[i] = -1;
+		ancestor[i] = -1;
+		bucket[i] = -1;
+		label[i] = i;
+	}
+	num = dfs(s, 0, 0, dfnum, vertex, parent, stack, next);
+	// the blocks that are kept by the runtime itself (finalizers, conservative scans) are held by the root
+	for(i=1;i<n;i++)
+		if( dfnum[i] < 0 ) {
+			s->roots[s->nroots++] = i;
+			s->unreached++;
+			parent[i] = 0;
+			num = dfs(s, i, num, dfnum, vertex, parent, stack, next);
+		}
+	// predecessors
+	for(v=0;v<n;v++)
+		for(e=SUCC_START(s,v);e<SUCC_END(s,v);e++)
+			pred_start[SUCC(s,v,e) + 1]++;
+	for(v=0;v<n;v++)
+		pred_start[v + 1] += pred_start[v];
+	preds = (int*)alloc(sizeof(int) * (pred_start[n] + 1));
+	memcpy(next, pred_start, sizeof(int64) * n);
+	for(v=0;v<n;v++)
+		for(e=SUCC_START(s,v);e<SUCC_END(s,v);e++)
+			preds[next[SUCC(s,v,e)]++] = v;
+
+	s->idom = (int*)alloc(sizeof(int) * n);
+	for(i=0;i<n;i++)
+		semi[i] = dfnum[i];
+	for(i=num-1;i>0;i--) {
+		int w = vertex[i], p = parent[w];
+		for(e=pred_start[w];e<pred_start[w+1];e++) {
+			int u = eval(preds[e], ancestor, label, semi, stack);
+			if( semi[u] < semi[w] ) semi[w] = semi[u];
+		}
+		bucket_next[w] = bucket[vertex[semi[w]]];
+		bucket[vertex[semi[w]]] = w;
+		ancestor[w] = p;
+		for(v=bucket[p];v>=0;v=bucket_next[v]) {
+			int u = eval(v, ancestor, label, semi, stack);
+			s->idom[v] = semi[u] < semi[v] ? u : p;
+		}
+		bucket[p] = -1;
+	}
+	for(i=1;i<num;i++) {
+		int w = vertex[i];
+		if( s->idom[w] != vertex[semi[w]] )
+			s->idom[w] = s->idom[s->idom[w]];
+	}
+	s->idom[0] = -1;
+
+	s->retained = (int64*)alloc(sizeof(int64) * n);
+	for(i=0;i<n;i++)
+		s->retained[i] = s->size_of[i];
+	for(i=num-1;i>0;i--) {
+		int w = vertex[i];
+		s->retained[s->idom[w]] += s->retained[w];
+	}
+	free(dfnum);
+	free(vertex);
+	free(parent);
+	free(semi);
+	free(ancestor);
+	free(label);
+	free(bucket);
+	free(bucket_next);
+	free(stack);
+	free(next);
+	free(pred_start);
+	free(preds);
+}
+
+// -------------------------  REPORTS ----------------------------------------------------------
+
+static const char *kind_names[] = {
+	"void", "ui8", "ui16", "i32", "i64", "f32", "f64", "bool", "bytes", "dynamic", "closure", "obj",
+	"array", "type", "ref", "virtual", "dynobj", "abstract", "enum", "null", "method", "struct", "?"
+};
+
+static const char *node_name( snapshot *s, int v ) {
+	snap_type *t;
+	if( v == 0 ) return "root";
+	if( s->type[v] == 0 ) {
+		switch( s->page_kind[v] ) {
+		case MEM_KIND_DYNAMIC: return "(dynamic)";
+		case MEM_KIND_RAW: return "(raw)";
+		case MEM_KIND_NOPTR: return "(noptr)";
+		case MEM_KIND_FINALIZER: return "(finalizer)";
+		default: return "?";
+		}
+	}
+	t = s->types + s->type[v];
+	if( t->name ) return t->name;
+	return kind_names[t->kind >= 0 && t->kind < HLAST ? t->kind : HLAST];
+}
+
+// the types of the dominators chain : "A < B" is an A retained by a B
+static void node_path( snapshot *s, int v, char *buf, int size ) {
+	int depth = 0, len = 0;
+	const char *last = NULL;
+	buf[0] = 0;
+	while( v >= 0 && depth < max_depth ) {
+		const char *name = node_name(s, v);
+		if( last == NULL || strcmp(last, name) != 0 ) {
+			int l = (int)strlen(name);
+			if( len + l + 4 >= size ) break;
+			if( last ) {
+				memcpy(buf + len, " < ", 3);
+				len += 3;
+			}
+			memcpy(buf + len, name, l);
+			len += l;
+			buf[len] = 0;
+			last = name;
+			depth++;
+		}
+		v = s->idom[v];
+	}
+}
+
+static stat_entry *stat_get( stat_table *t, const char *key ) {
+	unsigned int h = 2166136261u;
+	const char *k;
+	if( (t->count + 1) * 2 > t->size ) {
+		stat_entry *old = t->entries;
+		int i, osize = t->size;
+		t->size = osize ? osize << 1 : 1024;
+		t->entries = (stat_entry*)alloc(sizeof(stat_entry) * t->size);
+		t->count = 0;
+		for(i=0;i<osize;i++)
+			if( old[i].key ) {
+				stat_entry *e = stat_get(t, old[i].key);
+				free(e->key);
+				*e = old[i];
+			}
+		free(old);
+	}
+	for(k=key;*k;k++)
+		h = (h ^ (unsigned char)*k) * 16777619u;
+	h &= t->size - 1;
+	while( t->entries[h].key && strcmp(t->entries[h].key, key) != 0 )
+		h = (h + 1) & (t->size - 1);
+	if( t->entries[h].key == NULL ) {
+		t->entries[h].key = strdup(key);
+		t->count++;
+	}
+	return t->entries + h;
+}
+
+static void stats( snapshot *s, stat_table *types, stat_table *paths ) {
+	char buf[1024];
+	int v;
+	for(v=1;v<s->count;v++) {
+		const char *name = node_name(s, v);
+		stat_entry *e = stat_get(types, name);
+		e->count++;
+		e->bytes += s->size_of[v];
+		// only the outermost of nested blocks of the same type, so lists are not counted several times
+		if( strcmp(node_name(s, s->idom[v]), name) != 0 )
+			e->retained += s->retained[v];
+		node_path(s, v, buf, sizeof(buf));
+		e = stat_get(paths, buf);
+		e->count++;
+		e->bytes += s->size_of[v];
+		e->retained += s->retained[v];
+	}
+}
+
+static int sort_mode = 0;
+
+static int cmp_entries( const void *a, const void *b ) {
+	const stat_entry *x = *(stat_entry**)a, *y = *(stat_entry**)b;
+	int64 vx, vy;
+	switch( sort_mode ) {
+	case 0: vx = x->retained; vy = y->retained; break;
+	case 1: vx = x->bytes; vy = y->bytes; break;
+	default: vx = x->bytes - x->old_bytes; vy = y->bytes - y->old_bytes; break;
+	}
+	return vx > vy ? -1 : (vx < vy ? 1 : 0);
+}
+
+static stat_entry **sorted_entries( stat_table *t, int mode ) {
+	stat_entry **all = (stat_entry**)alloc(sizeof(stat_entry*) * (t->count + 1));
+	int i, n = 0;
+	for(i=0;i<t->size;i++)
+		if( t->entries[i].key ) all[n++] = t->entries + i;
+	sort_mode = mode;
+	qsort(all, n, sizeof(stat_entry*), cmp_entries);
+	return all;
+}
+
+static double kb( int64 bytes ) {
+	return bytes / 1024.;
+}
+
+static void print_summary( snapshot *s ) {
+	printf("%s : %d blocks, %.1f KB, %d types, %d roots, %d blocks not reachable from the roots\n",
+		s->file, s->count - 1, kb(s->bytes), s->ntypes - 1, s->nroots - s->unreached, s->unreached);
+}
+
+static void report( snapshot *s ) {
+	stat_table types = {0}, paths = {0};
+	stat_entry **all;
+	int *top;
+	int i, v, n = 0;
+	char buf[1024];
+	stats(s, &types, &paths);
+	print_summary(s);
+
+	printf("\nTypes by retained size\n%10s %12s %12s  %s\n", "count", "shallow KB", "retained KB", "type");
+	all = sorted_entries(&types, 0);
+	for(i=0;i<types.count && i<max_lines;i++)
+		printf("%10lld %12.1f %12.1f  %s\n", all[i]->count, kb(all[i]->bytes), kb(all[i]->retained), all[i]->key);
+	free(all);
+
+	printf("\nBiggest objects\n%12s  %s\n", "retained KB", "retaining path");
+	top = (int*)alloc(sizeof(int) * (max_lines + 1));
+	for(v=1;v<s->count && max_lines>0;v++) {
+		int p;
+		// only the outermost of nested blocks of the same type
+		if( strcmp(node_name(s, s->idom[v]), node_name(s, v)) == 0 ) continue;
+		if( n < max_lines )
+			top[n++] = v;
+		else if( s->retained[v] > s->retained[top[n - 1]] )
+			top[n - 1] = v;
+		else
+			continue;
+		for(p=n-1;p>0 && s->retained[top[p - 1]] < s->retained[v];p--) {
+			top[p] = top[p - 1];
+			top[p - 1] = v;
+		}
+	}
+	for(i=0;i<n;i++) {
+		node_path(s, top[i], buf, sizeof(buf));
+		printf("%12.1f  %s @%llx\n", kb(s->retained[top[i]]), buf, (uint64)s->addr[top[i]] * s->wsize);
+	}
+	free(top);
+
+	printf("\nRetaining paths by shallow size\n%10s %12s  %s\n", "count", "shallow KB", "path");
+	all = sorted_entries(&paths, 1);
+	for(i=0;i<paths.count && i<max_lines;i++)
+		printf("%10lld %12.1f  %s\n", all[i]->count, kb(all[i]->bytes), all[i]->key);
+	free(all);
+}
+
+static void merge_old( stat_table *cur, stat_table *old ) {
+	int i;
+	for(i=0;i<old->size;i++) {
+		stat_entry *o = old->entries + i, *e;
+		if( !o->key ) continue;
+		e = stat_get(cur, o->key);
+		e->old_count = o->count;
+		e->old_bytes = o->bytes;
+	}
+}
+
+static void print_growth( const char *title, const char *key, stat_table *t ) {
+	stat_entry **all = sorted_entries(t, 2);
+	int i;
+	printf("\n%s\n%10s %12s %12s  %s\n", title, "+count", "+KB", "KB", key);
+	for(i=0;i<t->count && i<max_lines;i++) {
+		stat_entry *e = all[i];
+		if( e->bytes <= e->old_bytes ) break;
+		printf("%+10lld %+12.1f %12.1f  %s\n", e->count - e->old_count, kb(e->bytes - e->old_bytes), kb(e->bytes), e->key);
+	}
+	free(all);
+}
+
+static void diff( snapshot *a, snapshot *b ) {
+	stat_table ta = {0}, pa = {0}, tb = {0}, pb = {0};
+	stats(a, &ta, &pa);
+	stats(b, &tb, &pb);
+	print_summary(a);
+	print_summary(b);
+	printf("growth : %+d blocks, %+.1f KB\n", b->count - a->count, kb(b->bytes - a->bytes));
+	merge_old(&tb, &ta);
+	merge_old(&pb, &pa);
+	print_growth("Growth by type", "type", &tb);
+	print_growth("Growth by retaining path", "path", &pb);
+}
+
+int main( int argc, char **argv ) {
+	const char *files[2];
+	int nfiles = 0, i;
+	snapshot s[2];
+	for(i=1;i<argc;i++) {
+		if( strcmp(argv[i], "-n") == 0 && i + 1 < argc )
+			max_lines = atoi(argv[++i]);
+		else if( strcmp(argv[i], "-depth") == 0 && i + 1 < argc )
+			max_depth = atoi(argv[++i]);
+		else if( nfiles < 2 && argv[i][0] != '-' )
+			files[nfiles++] = argv[i];
+		else
+			nfiles = 3;
+	}
+	if( nfiles == 0 || nfiles > 2 || max_depth < 1 ) {
+		printf("Usage: hlmem [-n lines] [-depth types] <snapshot> [<later snapshot>]\n");
+		printf("  one snapshot : types and objects by retained size, retaining paths\n");
+		printf("  two snapshots : growth by type and by retaining path\n");
+		return 1;
+	}
+	for(i=0;i<nfiles;i++) {
+		load(s + i, files[i]);
+		dominators(s + i);
+	}
+	if( nfiles == 1 )
+		report(s);
+	else
+		diff(s, s + 1);
+	return 0;
+}
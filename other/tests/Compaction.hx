@@ -0,0 +1,92 @@
+class Item {
+	public var id : Int;
+	public var check : Int;
+	public function new(id) {
+		this.id = id;
+		this.check = id * 31 + 7;
+	}
+}
+
+class Compaction {
+
+	static inline var COUNT = 20000;
+	static inline var STAT_COMPACT_MOVED = 25; // HL_GC_STAT_COMPACT_MOVED
+
+	// globals are root slots, their values are forwarded
+	static var kept : hl.NativeArray<Item>;
+	static var rooted : Item;
+
+	@:hlNative("std","gc_set_compaction") static function setCompaction( percent : Int ) : Void {
+	}
+
+	@:hlNative("std","gc_stats_ext") static function statsExt( values : hl.Bytes, count : Int ) : Int {
+		return 0;
+	}
+
+	@:hlNative("std","gc_alloc_weak") static function allocWeak( v : Dynamic ) : hl.Abstract<"hl_weak"> {
+		return null;
+	}
+
+	@:hlNative("std","gc_weak_get") static function weakGet( w : hl.Abstract<"hl_weak"> ) : Dynamic {
+		return null;
+	}
+
+	static function moved() : Float {
+		var values = new hl.Bytes(8 * 64);
+		statsExt(values, 64);
+		return values.getF64(STAT_COMPACT_MOVED * 8);
+	}
+
+	static function check( b : Bool, msg : String ) {
+		if( !b ) throw "Compaction failed : " + msg;
+	}
+
+	// only one object out of eight survives, so that their pages are sparse
+	static function fill( bytes : hl.NativeArray<hl.Bytes>, dup : hl.NativeArray<Item>, weaks : hl.NativeArray<hl.Abstract<"hl_weak">> ) {
+		var trash = new hl.NativeArray<Item>(64);
+		var trashBytes = new hl.NativeArray<hl.Bytes>(64);
+		kept = new hl.NativeArray<Item>(COUNT);
+		for( i in 0...COUNT ) {
+			for( k in 0...7 ) {
+				trash[(i * 7 + k) & 63] = new Item(-1);
+				trashBytes[(i * 7 + k) & 63] = new hl.Bytes(24);
+			}
+			var it = new Item(i);
+			var b = new hl.Bytes(24);
+			b.setI32(0, i);
+			b.setI32(20, ~i);
+			kept[i] = it;
+			bytes[i] = b;
+			if( i % 10 == 0 ) dup[i] = it;
+		}
+		for( i in 0...weaks.length )
+			weaks[i] = allocWeak(kept[i * 100]);
+		rooted = kept[COUNT >> 1];
+	}
+
+	static function main() {
+		var bytes = new hl.NativeArray<hl.Bytes>(COUNT);
+		var dup = new hl.NativeArray<Item>(COUNT);
+		var weaks = new hl.NativeArray<hl.Abstract<"hl_weak">>(Std.int(COUNT / 100));
+		setCompaction(50);
+		fill(bytes, dup, weaks);
+		var before = moved();
+		hl.Gc.major();
+		hl.Gc.major();
+		check(moved() > before, "nothing was moved");
+		for( i in 0...COUNT ) {
+			var it = kept[i];
+			check(it.id == i && it.check == i * 31 + 7, "object " + i + " contents");
+			var b = bytes[i];
+			check(b.getI32(0) == i && b.getI32(20) == ~i, "bytes " + i + " contents");
+			if( i % 10 == 0 ) check(dup[i] == it, "object " + i + " identity");
+		}
+		for( i in 0...weaks.length ) {
+			var it : Item = weakGet(weaks[i]);
+			check(it == kept[i * 100], "weak target " + i);
+		}
+		check(rooted == kept[COUNT >> 1], "root value");
+		trace("Compaction ok (" + Std.int(moved() - before) + " bytes moved)");
+	}
+
+}
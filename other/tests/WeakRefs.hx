@@ -0,0 +1,112 @@
+class Target {
+	public var id : Int;
+	public function new(id) {
+		this.id = id;
+	}
+}
+
+class WeakRefs {
+
+	static inline var COUNT = 1000;
+
+	static var live : hl.NativeArray<Target>;
+	static var keys : hl.NativeArray<Target>;
+
+	@:hlNative("std","gc_alloc_weak") static function allocWeak( v : Dynamic ) : hl.Abstract<"hl_weak"> {
+		return null;
+	}
+
+	@:hlNative("std","gc_weak_get") static function weakGet( w : hl.Abstract<"hl_weak"> ) : Dynamic {
+		return null;
+	}
+
+	@:hlNative("std","hwalloc") static function mapAlloc() : hl.Abstract<"hl_weak_map"> {
+		return null;
+	}
+
+	@:hlNative("std","hwset") static function mapSet( m : hl.Abstract<"hl_weak_map">, k : Dynamic, v : Dynamic ) : Void {
+	}
+
+	@:hlNative("std","hwget") static function mapGet( m : hl.Abstract<"hl_weak_map">, k : Dynamic ) : Dynamic {
+		return null;
+	}
+
+	static function check( b : Bool, msg : String ) {
+		if( !b ) throw "WeakRefs failed : " + msg;
+	}
+
+	// the even targets stay referenced, the odd ones are only weakly reachable
+	static function fillCells( cells : hl.NativeArray<hl.Abstract<"hl_weak">> ) {
+		live = new hl.NativeArray<Target>(COUNT);
+		for( i in 0...COUNT ) {
+			var t = new Target(i);
+			if( (i & 1) == 0 ) live[i] = t;
+			cells[i] = allocWeak(t);
+		}
+	}
+
+	// each key maps to a value only reachable from the map, tracked by a weak cell
+	static function fillMap( m : hl.Abstract<"hl_weak_map">, values : hl.NativeArray<hl.Abstract<"hl_weak">> ) {
+		keys = new hl.NativeArray<Target>(COUNT);
+		for( i in 0...COUNT ) {
+			var k = new Target(i);
+			var v = new Target(-i);
+			keys[i] = k;
+			mapSet(m, k, v);
+			values[i] = allocWeak(v);
+		}
+	}
+
+	static function dropOddKeys() {
+		for( i in 0...COUNT )
+			if( (i & 1) == 1 ) keys[i] = null;
+	}
+
+	static function main() {
+		var cells = new hl.NativeArray<hl.Abstract<"hl_weak">>(COUNT);
+		var values = new hl.NativeArray<hl.Abstract<"hl_weak">>(COUNT);
+		var m = mapAlloc();
+		fillCells(cells);
+		fillMap(m, values);
+		hl.Gc.major();
+
+		// a live target is kept, a dead one is cleared. the stacks are scanned
+		// conservatively, so a few dead targets can be retained
+		var cleared = 0;
+		for( i in 0...COUNT ) {
+			var t : Target = weakGet(cells[i]);
+			if( (i & 1) == 0 )
+				check(t == live[i], "live target " + i);
+			else if( t == null )
+				cleared++;
+			else
+				check(t.id == i, "dead target " + i + " contents");
+		}
+		check(cleared > COUNT / 4, "only " + cleared + " dead targets cleared");
+
+		// a value is kept while its key is
+		for( i in 0...COUNT ) {
+			var v : Target = mapGet(m, keys[i]);
+			check(v != null && v.id == -i, "value of key " + i);
+			var w : Target = weakGet(values[i]);
+			check(w == v, "weak value " + i);
+		}
+
+		// and collected with it
+		dropOddKeys();
+		hl.Gc.major();
+		cleared = 0;
+		for( i in 0...COUNT ) {
+			var w : Target = weakGet(values[i]);
+			if( (i & 1) == 0 ) {
+				check(w != null && w.id == -i, "value of live key " + i);
+				var v : Target = mapGet(m, keys[i]);
+				check(v == w, "map value of live key " + i);
+			} else if( w == null )
+				cleared++;
+		}
+		check(cleared > COUNT / 4, "only " + cleared + " values of dead keys cleared");
+		trace("WeakRefs ok");
+	}
+
+}
@@ -20,6 +20,7 @@
  * DEALINGS IN THE SOFTWARE.
  */
 #include "hl.h"
+#include <limits.h>
 #ifdef HL_WIN
 #	include <windows.h>
 #	include <intrin.h>
@@ -35,15 +36,32 @@ static unsigned int __inline TRAILING_ZEROES( unsigned int x ) {
 		return msb;
 	return 32;
 }
+#	define ATOMIC_OR8(ptr,v)	_InterlockedOr8((char*)(ptr),(char)(v))
+#	define ATOMIC_ADD(ptr,v)	_InterlockedExchangeAdd((long volatile*)(ptr),(long)(v))
+#	define ATOMIC_ADD64(ptr,v)	InterlockedExchangeAdd64((LONGLONG volatile*)(ptr),(LONGLONG)(v))
+#	define ATOMIC_FENCE()		MemoryBarrier()
+#	define ATOMIC_CAS(ptr,old,v)	(_InterlockedCompareExchange((long volatile*)(ptr),(long)(v),(long)(old)) == (long)(old))
+#	define ATOMIC_LOAD(ptr)		(*(long volatile*)(ptr))
+#	define PREFETCH(ptr)			_mm_prefetch((const char*)(ptr),_MM_HINT_T0)
 #else
 #	include <sys/types.h>
 #	include <sys/mman.h>
+#	include <pthread.h>
+#	include <sched.h>
+#	include <time.h>
 static inline unsigned int TRAILING_ONES( unsigned int x ) {
 	return (~x) ? __builtin_ctz(~x) : 32;
 }
 static inline unsigned int TRAILING_ZEROES( unsigned int x ) {
 	return x ? __builtin_ctz(x) : 32;
 }
+#	define ATOMIC_OR8(ptr,v)	__atomic_fetch_or((unsigned char*)(ptr),(unsigned char)(v),__ATOMIC_RELAXED)
+#	define ATOMIC_ADD(ptr,v)	__atomic_fetch_add(ptr,v,__ATOMIC_SEQ_CST)
+#	define ATOMIC_ADD64(ptr,v)	__atomic_fetch_add(ptr,v,__ATOMIC_SEQ_CST)
+#	define ATOMIC_FENCE()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#	define ATOMIC_CAS(ptr,old,v)	__sync_bool_compare_and_swap(ptr,old,v)
+#	define ATOMIC_LOAD(ptr)		__atomic_load_n(ptr,__ATOMIC_ACQUIRE)
+#	define PREFETCH(ptr)			__builtin_prefetch(ptr)
 #endif
 #	define MZERO(ptr,size)		memset(ptr,0,size)
 
@@ -64,6 +82,11 @@ static inline unsigned int TRAILING_ZEROES( unsigned int x ) {
 #	define GC_LEVEL0_BITS		10
 #	define GC_LEVEL1_BITS		10
 #	define GC_ALIGN_BITS		3
+#	ifndef HL_CONSOLE
+// all pages are allocated in a single reserved address range
+// and indexed by their offset in it
+#	define GC_HEAP_RANGE
+#	endif
 
 // we currently discard the higher bits
 // we should instead have some special handling for them
@@ -71,7 +94,7 @@ static inline unsigned int TRAILING_ZEROES( unsigned int x ) {
 
 #ifdef HL_WIN
 #	define gc_hash(ptr)			((int_val)(ptr)&0x0000000FFFFFFFFF)
-#else
+#elif !defined(GC_HEAP_RANGE)
 // Linux gives addresses using the following patterns (X=any,Y=small value - can be 0): 
 //		0x0000000YXXX0000
 //		0x0007FY0YXXX0000
@@ -84,9 +107,16 @@ static int_val gc_hash( void *ptr ) {
 #endif
 
 #define GC_MASK_BITS		16
+#ifdef GC_HEAP_RANGE
+#define GC_PAGE_INDEX(ptr)	((size_t)((int_val)(ptr) - (int_val)gc_heap.base) >> GC_MASK_BITS)
+#define GC_GET_PAGE(ptr)	((size_t)((int_val)(ptr) - (int_val)gc_heap.base) < gc_heap.size ? gc_heap.pages[GC_PAGE_INDEX(ptr)] : NULL)
+#define GC_SET_PAGE(ptr,p)	gc_heap.pages[GC_PAGE_INDEX(ptr)] = p
+#else
 #define GC_GET_LEVEL1(ptr)	hl_gc_page_map[gc_hash(ptr)>>(GC_MASK_BITS+GC_LEVEL1_BITS)]
 #define GC_GET_PAGE(ptr)	GC_GET_LEVEL1(ptr)[(gc_hash(ptr)>>GC_MASK_BITS)&GC_LEVEL1_MASK]
+#define GC_SET_PAGE(ptr,p)	GC_GET_PAGE(ptr) = p
 #define GC_LEVEL1_MASK		((1 << GC_LEVEL1_BITS) - 1)
+#endif
 
 #define PAGE_KIND_BITS		2
 #define PAGE_KIND_MASK		((1 << PAGE_KIND_BITS) - 1)
@@ -96,6 +126,18 @@ static int_val gc_hash( void *ptr ) {
 #	define GC_MEMCHK
 #endif
 
+#if defined(HL_THREADS) && !defined(HL_CONSOLE)
+#	define GC_PARALLEL
+#endif
+
+#if !defined(HL_WIN) && !defined(HL_CONSOLE)
+#	define GC_SNAPSHOT_FORK
+#	include <unistd.h>
+#	include <errno.h>
+#	include <fcntl.h>
+#	include <sys/wait.h>
+#endif
+
 #define out_of_memory(reason)		hl_fatal("Out of Memory (" reason ")")
 
 typedef struct _gc_pheader gc_pheader;
@@ -108,14 +150,25 @@ struct _gc_pheader {
 	int block_size;
 	int max_blocks;
 	int first_block;
+	int block_shift;
+	uint64 block_mul;
 	// mutable
 	int next_block;
 	int free_blocks;
+	int zero_block; // the blocks from this one were not allocated since the page memory was cleared
 	unsigned char *sizes;
 	unsigned char *bmp;
 	int sizes_ref;
 	int sizes_ref2;
+	int bmp_ref;
+	hl_thread_info *owner;
 	gc_pheader *next_page;
+	bool alloc_marked; // created during an incremental mark : blocks are allocated marked
+	int pid;
+	int mark_epoch; // major cycle in which bmp was cleared
+	int sweep_epoch; // collection after which the page was last swept
+	gc_pheader *next_free; // in gc_free_runs
+	unsigned char *pins; // blocks that can't move, only set while the page is compacted
 #ifdef GC_DEBUG
 	int page_id;
 #endif
@@ -124,6 +177,17 @@ struct _gc_pheader {
 #define GC_PARTITIONS	9
 #define GC_PART_BITS	4
 #define GC_FIXED_PARTS	5
+// the last partition holds the large objects, each in its own page of the exact size
+#define GC_LARGE_PART	(GC_PARTITIONS - 1)
+#define GC_LARGE_SIZE	(1 << 20)
+#define GC_IS_LARGE(p)	(((p)->pid >> PAGE_KIND_BITS) == GC_LARGE_PART)
+// index of the block holding a page offset, with a multiply instead of a divide
+#define GC_BLOCK_INDEX(p,off)	((int)(((uint64)(off) * (p)->block_mul) >> (p)->block_shift))
+#if defined(GC_DEBUG) || defined(HL_CONSOLE)
+#	define GC_SYS_ZERO	false
+#else
+#	define GC_SYS_ZERO	true // fresh or decommitted memory is zero filled by the system
+#endif
 static const int GC_SBITS[GC_PARTITIONS] = {0,0,0,0,0,		3,6,14,22};
 
 #ifdef HL_64
@@ -142,13 +206,26 @@ static const int GC_SIZES[GC_PARTITIONS] = {4,8,12,16,20,	8,64,1<<14,1<<22};
 #define GC_DUMP_MEM		2
 #define GC_NO_THREADS	4
 #define GC_FORCE_MAJOR	8
+#define GC_HUGE_PAGES	16
 
 static int gc_flags = 0;
 static gc_pheader *gc_pages[GC_ALL_PAGES] = {NULL};
-static int gc_free_blocks[GC_ALL_PAGES] = {0};
+static int gc_pages_count[GC_ALL_PAGES] = {0};
 static gc_pheader *gc_free_pages[GC_ALL_PAGES] = {NULL};
+#ifdef GC_HEAP_RANGE
+typedef struct _gc_heap_free gc_heap_free;
+static struct {
+	unsigned char *base;
+	unsigned char *top;
+	size_t size;
+	gc_pheader **pages;
+	gc_heap_free *free;
+} gc_heap = {0};
+static int64 gc_heap_reserve = (int64)64 << 30;
+#else
 static gc_pheader *gc_level1_null[1<<GC_LEVEL1_BITS] = {NULL};
 static gc_pheader **hl_gc_page_map[1<<GC_LEVEL0_BITS] = {NULL};
+#endif
 static gc_pheader *gc_free_pheaders = NULL;
 
 static struct {
@@ -159,6 +236,10 @@ static struct {
 } gc_threads;
 
 HL_THREAD_STATIC_VAR hl_thread_info *current_thread;
+#ifdef HL_GC_STACK_MAPS
+// written by JIT code relative to the thread pointer : must be in the static TLS block
+static __thread __attribute__((tls_model("initial-exec"))) void *gc_jit_frame[2];
+#endif
 
 static struct {
 	int64 total_requested;
@@ -167,32 +248,182 @@ static struct {
 	int64 last_mark_allocs;
 	int64 pages_total_memory;
 	int64 allocation_count;
+	int64 large_memory;
+	int64 mark_scanned;
+	int64 last_scanned;
+	int64 mark_time; // ns
+	int64 alloc_time; // only measured if gc_profile active
 	int pages_count;
 	int pages_allocated;
 	int pages_blocks;
-	int mark_bytes;
-	int mark_time;
+	int large_count;
 	int mark_count;
-	int alloc_time; // only measured if gc_profile active
 } gc_stats = {0};
 
 static struct {
 	int64 total_allocated;
 	int64 allocation_count;
-	int alloc_time;
+	int64 alloc_time;
 } last_profile;
 
-#ifdef HL_WIN
-#	define TIMESTAMP() ((int)GetTickCount())
-#else
-#	define TIMESTAMP() 0
-#endif
+struct hl_alloc_block {
+	int size;
+	hl_alloc_block *next;
+	unsigned char *p;
+};
+
+// the objects allocated with MEM_ARENA while an arena is set on the thread are taken from it,
+// it is scanned as a root until freed at once with everything it contains.
+// an arena is not thread safe : it can only be set on one registered thread at a time
+struct _hl_arena {
+	hl_alloc alloc;
+	int64 size;
+	hl_thread_info *owner;
+	hl_arena *next;
+};
+
+static hl_arena *gc_arenas = NULL;
+
+// each registered thread owns at most one page per small partition and allocates
+// into it without taking the global lock ; stats are merged back on refill
+#define GC_LOCAL_PARTS	7
+
+typedef struct {
+	gc_pheader *pages[GC_LOCAL_PARTS << PAGE_KIND_BITS];
+	int64 total_requested;
+	int64 total_allocated;
+	int64 allocation_count;
+	int64 thread_allocated; // merged part of the thread total
+	void ***roots; // pushed with hl_push_root, only read while the thread is stopped
+	int roots_count;
+	int roots_max;
+	hl_arena *arena;
+} gc_local;
+
+// var pages that are not used by an allocator are indexed by their largest known free run.
+// runs below 32 blocks have their own bucket, larger ones are grouped by power of two
+#define GC_RUN_BUCKETS	(32 + 11)
+static gc_pheader *gc_free_runs[GC_ALL_PAGES][GC_RUN_BUCKETS] = {{NULL}};
+// current var page of allocations that are not thread local
+static gc_pheader *gc_shared_pages[GC_ALL_PAGES] = {NULL};
+static void gc_free_index_add( gc_pheader *p );
+
+// generational mode : blocks marked by a collection stay marked (old) and minor collections
+// only trace the blocks allocated since the last one, plus the old blocks in dirty cards
+#define GC_CARD_SIZE	(1 << HL_GC_CARD_BITS)
+#define GC_CARD(ptr)	hl_gc_cards[((int_val)(ptr) >> HL_GC_CARD_BITS) & (HL_GC_CARDS - 1)]
+#define GC_CARD_NEXT	2	// keep dirty for the next collection
+#define GC_MAX_MINORS	8
+
+unsigned char hl_gc_cards[HL_GC_CARDS] = {0};
+static bool gc_generational = false;
+static bool gc_mark_minor = false;
+static int gc_minor_count = 0;
+static int64 gc_major_memory = 0;
+static bool gc_barriers = false;
+static bool gc_barriers_fixed = false;
+
+// incremental mode : a major mark is split in slices bounded by gc_pause_target and the
+// mutators run in between ; the blocks they store into are rescanned when the mark completes.
+// the pages existing when the mark started are not reused before it completes
+#define GC_SLICE_WORK		1024
+#define GC_PAUSE_BUCKETS	24
+#define GC_CARDS_ACTIVE()	(gc_generational || gc_pause_target > 0)
+
+static int64 gc_pause_target = 0; // ns
+static bool gc_mark_phase = false;
+static int64 gc_last_slice = 0;
+static int64 gc_cycle_time = 0;
+
+// each page keeps its bitmap : it only holds marks if it was cleared during the current major
+// cycle, which the first mark reaching the page does, so starting a cycle is O(1).
+// after a collection a page is swept the first time the allocator uses it, the others a few
+// at a time on each refill, so the pause doesn't depend on the heap size
+#define GC_PAGE_MARKED(p)	((p)->mark_epoch == gc_mark_epoch)
+#define GC_EPOCH_BUSY		-1
+#define GC_SWEEP_PAGES		8
+
+static int gc_mark_epoch = 1;
+static int gc_sweep_epoch = 0;
+static struct {
+	int pid;
+	gc_pheader **link; // to the next page to sweep
+} gc_sweep = { -1, NULL };
+
+#define GC_PAUSE_RECENT		1024
+
+static struct {
+	int count;
+	int64 max;
+	int64 total;
+	int buckets[GC_PAUSE_BUCKETS]; // pauses in [2^(i-1),2^i[ us
+	int64 recent[GC_PAUSE_RECENT]; // ring of the last pauses, for percentiles
+} gc_pauses = {0};
+
+// time spent in each phase, during the collection in progress or the last one
+// (including the lazy sweep that followed it) and since startup. with parallel marking,
+// roots and stacks are the share of the collecting thread and mark lasts until all the
+// mark threads are done : these are wall times, not summed over the threads
+typedef enum {
+	GC_PHASE_ROOTS,
+	GC_PHASE_STACKS,
+	GC_PHASE_MARK,
+	GC_PHASE_FINALIZE,
+	GC_PHASE_RELEASE,
+	GC_PHASES
+} gc_phase;
+
+static struct {
+	int64 last[GC_PHASES];
+	int64 total[GC_PHASES];
+} gc_phases = {{0}};
+
+// monotonic nanoseconds
+static int64 gc_clock() {
+#	if defined(HL_WIN)
+	static LARGE_INTEGER freq = {0};
+	LARGE_INTEGER t;
+	if( !freq.QuadPart ) QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&t);
+	return (t.QuadPart / freq.QuadPart) * 1000000000 + ((t.QuadPart % freq.QuadPart) * 1000000000) / freq.QuadPart;
+#	elif defined(HL_CONSOLE)
+	return 0;
+#	else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return (int64)t.tv_sec * 1000000000 + t.tv_nsec;
+#	endif
+}
+
+static void gc_record_pause( int64 dt ) {
+	int64 us = dt / 1000;
+	int b = 0;
+	while( b < GC_PAUSE_BUCKETS - 1 && (us >> b) )
+		b++;
+	gc_pauses.recent[gc_pauses.count % GC_PAUSE_RECENT] = dt;
+	gc_pauses.count++;
+	gc_pauses.total += dt;
+	if( dt > gc_pauses.max ) gc_pauses.max = dt;
+	gc_pauses.buckets[b]++;
+}
+
+static void gc_phase_time( gc_phase ph, int64 start ) {
+	int64 dt = gc_clock() - start;
+	gc_phases.last[ph] += dt;
+	gc_phases.total[ph] += dt;
+}
 
 // -------------------------  ROOTS ----------------------------------------------------------
 
+// the handle of a root is its slot index. free slots are chained with odd values, which
+// can't be mistaken for the address of a root : (next + 1) * 2 + 1, so the end of the
+// chain (-1) is never shifted
 static void ***gc_roots = NULL;
 static int gc_roots_count = 0;
 static int gc_roots_max = 0;
+static int gc_roots_free = -1;
+
+#define GC_ROOT_FREE(r)		(((int_val)(r)) & 1)
 
 HL_API hl_thread_info *hl_get_thread() {
 	return current_thread;
@@ -201,11 +432,17 @@ HL_API hl_thread_info *hl_get_thread() {
 static void gc_save_context(hl_thread_info *t ) {
 	setjmp(t->gc_regs);
 	t->stack_cur = &t;
+#	ifdef HL_GC_STACK_MAPS
+	t->stack_jit[0] = gc_jit_frame[0];
+	t->stack_jit[1] = gc_jit_frame[1];
+#	endif
 }
 
 #ifndef HL_THREADS
 #	define gc_global_lock(_)
 #else
+static void gc_safepoint_enter( void );
+
 static void gc_global_lock( bool lock ) {
 	hl_thread_info *t = current_thread;
 	bool mt = (gc_flags & GC_NO_THREADS) == 0;
@@ -214,7 +451,7 @@ static void gc_global_lock( bool lock ) {
 		if( !t )
 			hl_fatal("Can't lock GC in unregistered thread");
 		if( mt ) gc_save_context(t);
-		t->gc_blocking++;
+		if( t->gc_blocking++ == 0 && mt ) gc_safepoint_enter();
 		if( mt ) hl_mutex_acquire(gc_threads.global_lock);
 	} else {
 		t->gc_blocking--;
@@ -244,32 +481,154 @@ static gc_pheader *gc_alloc_page_header( void *base, int size ) {
 	return p;
 }
 
-HL_PRIM void hl_add_root( void *r ) {
+HL_PRIM int hl_add_root( void *r ) {
+	int h;
+	gc_global_lock(true);
+	if( gc_roots_free >= 0 ) {
+		h = gc_roots_free;
+		gc_roots_free = (int)((int_val)gc_roots[h] >> 1) - 1;
+	} else {
+		if( gc_roots_count == gc_roots_max ) {
+			int nroots = gc_roots_max ? (gc_roots_max << 1) : 16;
+			void ***roots = (void***)malloc(sizeof(void*)*nroots);
+			if( roots == NULL ) out_of_memory("roots");
+			memcpy(roots,gc_roots,sizeof(void*)*gc_roots_count);
+			free(gc_roots);
+			gc_roots = roots;
+			gc_roots_max = nroots;
+		}
+		h = gc_roots_count++;
+	}
+	gc_roots[h] = (void**)r;
+	gc_global_lock(false);
+	return h;
+}
+
+static void gc_free_root( int h ) {
+	gc_roots[h] = (void**)((((int_val)gc_roots_free + 1) << 1) | 1);
+	gc_roots_free = h;
+}
+
+HL_PRIM void hl_remove_root_handle( int h ) {
 	gc_global_lock(true);
-	if( gc_roots_count == gc_roots_max ) {
-		int nroots = gc_roots_max ? (gc_roots_max << 1) : 16;
-		void ***roots = (void***)malloc(sizeof(void*)*nroots);
-		memcpy(roots,gc_roots,sizeof(void*)*gc_roots_count);
-		free(gc_roots);
-		gc_roots = roots;
-		gc_roots_max = nroots;
-	}
-	gc_roots[gc_roots_count++] = (void**)r;
+	if( h < 0 || h >= gc_roots_count || GC_ROOT_FREE(gc_roots[h]) )
+		hl_fatal("Invalid root handle");
+	gc_free_root(h);
 	gc_global_lock(false);
 }
 
+// prefer the handle returned by hl_add_root, this has to search for the slot
 HL_PRIM void hl_remove_root( void *v ) {
 	int i;
 	gc_global_lock(true);
 	for(i=gc_roots_count-1;i>=0;i--)
 		if( gc_roots[i] == (void**)v ) {
-			gc_roots_count--;
-			memmove(gc_roots + i, gc_roots + (i+1), (gc_roots_count - i) * sizeof(void*));
+			gc_free_root(i);
 			break;
 		}
 	gc_global_lock(false);
 }
 
+// roots pushed by a thread are scanned with its stack : they don't need the global lock
+// but can't be used while the thread is blocking
+HL_API void hl_push_root( void *r ) {
+	hl_thread_info *t = current_thread;
+	gc_local *l;
+	if( !t ) hl_fatal("Can't push root in unregistered thread");
+	l = (gc_local*)t->gc_local;
+	if( l->roots_count == l->roots_max ) {
+		int nroots = l->roots_max ? (l->roots_max << 1) : 16;
+		void ***roots = (void***)realloc(l->roots,sizeof(void*)*nroots);
+		if( roots == NULL ) out_of_memory("roots");
+		l->roots = roots;
+		l->roots_max = nroots;
+	}
+	l->roots[l->roots_count++] = (void**)r;
+}
+
+HL_API void hl_pop_root() {
+	gc_local *l = (gc_local*)current_thread->gc_local;
+	if( l->roots_count == 0 ) hl_fatal("Root stack underflow");
+	l->roots_count--;
+}
+
+#ifdef HL_GC_STACK_MAPS
+// -------------------------  JIT FRAMES -------------------------------------------------------
+
+typedef struct {
+	unsigned char *code;
+	int size;
+	int nsites;
+	hl_gc_stack_site *sites;
+	unsigned int *maps;
+} gc_code_block;
+
+static gc_code_block *gc_code = NULL;
+static int gc_code_count = 0;
+
+HL_API void **hl_gc_jit_frame() {
+	return gc_jit_frame;
+}
+
+// sites must be sorted by return address, the GC keeps them
+HL_API void hl_gc_register_code( unsigned char *code, int size, hl_gc_stack_site *sites, int nsites, unsigned int *maps ) {
+	gc_code_block *b;
+	gc_global_lock(true);
+	b = (gc_code_block*)malloc(sizeof(gc_code_block) * (gc_code_count + 1));
+	if( b == NULL ) out_of_memory("code maps");
+	memcpy(b,gc_code,sizeof(gc_code_block) * gc_code_count);
+	free(gc_code);
+	gc_code = b;
+	b += gc_code_count;
+	b->code = code;
+	b->size = size;
+	b->nsites = nsites;
+	b->sites = sites;
+	b->maps = maps;
+	gc_code_count++;
+	gc_global_lock(false);
+}
+
+// must be called before the code is freed, releases its sites and maps
+HL_API void hl_gc_unregister_code( unsigned char *code ) {
+	int i;
+	gc_global_lock(true);
+	for(i=0;i<gc_code_count;i++) {
+		gc_code_block *b = gc_code + i;
+		if( b->code != code ) continue;
+		free(b->sites);
+		free(b->maps);
+		*b = gc_code[--gc_code_count];
+		break;
+	}
+	gc_global_lock(false);
+}
+
+static hl_gc_stack_site *gc_find_site( void *ret, unsigned int **maps ) {
+	int i;
+	for(i=0;i<gc_code_count;i++) {
+		gc_code_block *b = gc_code + i;
+		int pos, min = 0, max = b->nsites;
+		if( (unsigned char*)ret < b->code || (unsigned char*)ret >= b->code + b->size ) continue;
+		pos = (int)((unsigned char*)ret - b->code);
+		while( min < max ) {
+			int mid = (min + max) >> 1;
+			hl_gc_stack_site *s = b->sites + mid;
+			if( s->ret < pos )
+				min = mid + 1;
+			else if( s->ret > pos )
+				max = mid;
+			else {
+				*maps = b->maps;
+				return s;
+			}
+		}
+		break;
+	}
+	return NULL;
+}
+#endif
+
 HL_PRIM gc_pheader *hl_gc_get_page( void *v ) {
 	gc_pheader *page = GC_GET_PAGE(v);
 	if( page && !INPAGE(v,page) )
@@ -281,18 +640,113 @@ HL_PRIM gc_pheader *hl_gc_get_page( void *v ) {
 
 HL_API int hl_thread_id();
 
+#ifdef GC_PARALLEL
+// native sync primitives for GC internal threads, which must not allocate
+
+#ifdef HL_WIN
+typedef CRITICAL_SECTION gc_mutex;
+#	define gc_mutex_init(m)		InitializeCriticalSection(m)
+#	define gc_mutex_lock(m)		EnterCriticalSection(m)
+#	define gc_mutex_unlock(m)	LeaveCriticalSection(m)
+#	define gc_yield()			SwitchToThread()
+typedef CONDITION_VARIABLE gc_cond;
+#	define gc_cond_init(c)		InitializeConditionVariable(c)
+#	define gc_cond_wait(c,m)	SleepConditionVariableCS(c,m,INFINITE)
+#	define gc_cond_signal(c)	WakeConditionVariable(c)
+#	define gc_cond_broadcast(c)	WakeAllConditionVariable(c)
+#else
+typedef pthread_mutex_t gc_mutex;
+#	define gc_mutex_init(m)		pthread_mutex_init(m,NULL)
+#	define gc_mutex_lock(m)		pthread_mutex_lock(m)
+#	define gc_mutex_unlock(m)	pthread_mutex_unlock(m)
+#	define gc_yield()			sched_yield()
+typedef pthread_cond_t gc_cond;
+#	define gc_cond_init(c)		pthread_cond_init(c,NULL)
+#	define gc_cond_wait(c,m)	pthread_cond_wait(c,m)
+#	define gc_cond_signal(c)	pthread_cond_signal(c)
+#	define gc_cond_broadcast(c)	pthread_cond_broadcast(c)
+#endif
+
+typedef struct {
+#	ifdef HL_WIN
+	HANDLE sem;
+#	else
+	gc_mutex lock;
+	gc_cond cond;
+	int count;
+#	endif
+} gc_sem;
+
+static void gc_sem_init( gc_sem *s ) {
+#	ifdef HL_WIN
+	s->sem = CreateSemaphore(NULL,0,1 << 30,NULL);
+#	else
+	gc_mutex_init(&s->lock);
+	gc_cond_init(&s->cond);
+	s->count = 0;
+#	endif
+}
+
+static void gc_sem_post( gc_sem *s ) {
+#	ifdef HL_WIN
+	ReleaseSemaphore(s->sem,1,NULL);
+#	else
+	gc_mutex_lock(&s->lock);
+	s->count++;
+	gc_cond_signal(&s->cond);
+	gc_mutex_unlock(&s->lock);
+#	endif
+}
+
+static void gc_sem_wait( gc_sem *s ) {
+#	ifdef HL_WIN
+	WaitForSingleObject(s->sem,INFINITE);
+#	else
+	gc_mutex_lock(&s->lock);
+	while( s->count == 0 )
+		gc_cond_wait(&s->cond,&s->lock);
+	s->count--;
+	gc_mutex_unlock(&s->lock);
+#	endif
+}
+#endif
+
+// must be called with the global lock held or the world stopped
+static void gc_local_flush( hl_thread_info *t ) {
+	gc_local *l = (gc_local*)t->gc_local;
+	int i;
+	if( !l ) return;
+	for(i=0;i<GC_LOCAL_PARTS << PAGE_KIND_BITS;i++) {
+		gc_pheader *p = l->pages[i];
+		if( p ) {
+			p->owner = NULL;
+			l->pages[i] = NULL;
+			gc_free_index_add(p);
+		}
+	}
+	gc_stats.total_requested += l->total_requested;
+	gc_stats.total_allocated += l->total_allocated;
+	gc_stats.allocation_count += l->allocation_count;
+	l->thread_allocated += l->total_allocated;
+	l->total_requested = 0;
+	l->total_allocated = 0;
+	l->allocation_count = 0;
+}
+
 HL_API void hl_register_thread( void *stack_top ) {
 	if( hl_get_thread() )
 		hl_fatal("Thread already registered");
 
 	hl_thread_info *t = (hl_thread_info*)malloc(sizeof(hl_thread_info));
 	memset(t, 0, sizeof(hl_thread_info));
+	t->gc_local = malloc(sizeof(gc_local));
+	memset(t->gc_local, 0, sizeof(gc_local));
 	t->thread_id = hl_thread_id();
 	t->stack_top = stack_top;
 	t->flags = HL_TRACK_MASK << HL_TREAD_TRACK_SHIFT;
 	current_thread = t;
-	hl_add_root(&t->exc_value);
-	hl_add_root(&t->exc_handler);
+	hl_push_root(&t->exc_value);
+	hl_push_root(&t->exc_handler);
 
 	gc_global_lock(true);
 	hl_thread_info **all = (hl_thread_info**)malloc(sizeof(void*) * (gc_threads.count + 1));
@@ -302,13 +756,13 @@ HL_API void hl_register_thread( void *stack_top ) {
 	gc_global_lock(false);
 }
 
+void hl_track_thread_exit( hl_thread_info *t );
+
 HL_API void hl_unregister_thread() {
 	int i;
 	hl_thread_info *t = hl_get_thread();
 	if( !t )
 		hl_fatal("Thread not registered");
-	hl_remove_root(&t->exc_value);
-	hl_remove_root(&t->exc_handler);
 	gc_global_lock(true);
 	for(i=0;i<gc_threads.count;i++)
 		if( gc_threads.threads[i] == t ) {
@@ -316,6 +770,11 @@ HL_API void hl_unregister_thread() {
 			gc_threads.count--;
 			break;
 		}
+	gc_local_flush(t);
+	if( ((gc_local*)t->gc_local)->arena ) ((gc_local*)t->gc_local)->arena->owner = NULL;
+	hl_track_thread_exit(t);
+	free(((gc_local*)t->gc_local)->roots);
+	free(t->gc_local);
 	free(t);
 	current_thread = NULL;
 	// don't use gc_global_lock(false)
@@ -326,11 +785,78 @@ HL_API void *hl_gc_threads_info() {
 	return &gc_threads;
 }
 
+volatile int hl_gc_stop_request = 0;
+
+#ifdef GC_PARALLEL
+// stop-the-world handshake : the collector sleeps until every thread is blocking, and
+// the threads that stop blocking meanwhile sleep until the world is resumed
+static struct {
+	gc_mutex lock;
+	gc_cond stopped;
+	gc_cond resumed;
+} gc_safepoint;
+#endif
+
+#ifdef HL_THREADS
+// called by the current thread when its gc_blocking goes from 0 to 1
+static void gc_safepoint_enter() {
+#	ifdef GC_PARALLEL
+	ATOMIC_FENCE();
+	if( gc_threads.stopping_world ) {
+		gc_mutex_lock(&gc_safepoint.lock);
+		gc_cond_signal(&gc_safepoint.stopped);
+		gc_mutex_unlock(&gc_safepoint.lock);
+	}
+#	endif
+}
+#endif
+
+// called by the current thread instead of t->gc_blocking-- when it is 1
+static void gc_safepoint_leave( hl_thread_info *t ) {
+	t->gc_blocking--;
+#	if defined(GC_PARALLEL)
+	ATOMIC_FENCE();
+	if( !gc_threads.stopping_world )
+		return;
+	gc_mutex_lock(&gc_safepoint.lock);
+	t->gc_blocking++;
+	gc_cond_signal(&gc_safepoint.stopped);
+	while( gc_threads.stopping_world )
+		gc_cond_wait(&gc_safepoint.resumed,&gc_safepoint.lock);
+	t->gc_blocking--;
+	gc_mutex_unlock(&gc_safepoint.lock);
+#	elif defined(HL_THREADS)
+	if( gc_threads.stopping_world ) {
+		gc_global_lock(true);
+		gc_global_lock(false);
+	}
+#	endif
+}
+
 static void gc_stop_world( bool b ) {
-#	ifdef HL_THREADS
+#	if defined(GC_PARALLEL)
+	int i;
+	gc_mutex_lock(&gc_safepoint.lock);
+	if( b ) {
+		gc_threads.stopping_world = true;
+		hl_gc_stop_request = 1;
+		ATOMIC_FENCE();
+		for(i=0;i<gc_threads.count;i++) {
+			hl_thread_info *t = gc_threads.threads[i];
+			while( t->gc_blocking == 0 )
+				gc_cond_wait(&gc_safepoint.stopped,&gc_safepoint.lock);
+		}
+	} else {
+		gc_threads.stopping_world = false;
+		hl_gc_stop_request = 0;
+		gc_cond_broadcast(&gc_safepoint.resumed);
+	}
+	gc_mutex_unlock(&gc_safepoint.lock);
+#	elif defined(HL_THREADS)
 	if( b ) {
 		int i;
 		gc_threads.stopping_world = true;
+		hl_gc_stop_request = 1;
 		for(i=0;i<gc_threads.count;i++) {
 			hl_thread_info *t = gc_threads.threads[i];
 			while( t->gc_blocking == 0 ) {}; // spinwait
@@ -338,6 +864,7 @@ static void gc_stop_world( bool b ) {
 	} else {
 		// releasing global lock will release all threads
 		gc_threads.stopping_world = false;
+		hl_gc_stop_request = 0;
 	}
 #	else
 	if( b ) gc_save_context(current_thread);
@@ -346,51 +873,51 @@ static void gc_stop_world( bool b ) {
 
 // -------------------------  ALLOCATOR ----------------------------------------------------------
 
-static void *gc_alloc_page_memory( int size );
+static void *gc_alloc_page_memory( int size, bool *zero );
 static void gc_free_page_memory( void *ptr, int size );
+static void *gc_sys_alloc( int size, bool commit );
+static void gc_sys_free( void *ptr, int size );
+static void gc_mem_trim( void );
+static void gc_page_sweep( gc_pheader *p );
+static void gc_sweep_pages( int budget );
 
-static bool is_zero( void *ptr, int size ) {
-	static char ZEROMEM[256] = {0};
-	unsigned char *p = (unsigned char*)ptr;
-	while( size>>8 ) {
-		if( memcmp(p,ZEROMEM,256) ) return false;
-		p += 256;
-		size -= 256;
+static void gc_set_cards( void *ptr, int size, unsigned char v ) {
+	unsigned char *p = (unsigned char*)((int_val)ptr & ~(GC_CARD_SIZE - 1));
+	unsigned char *end = (unsigned char*)ptr + size;
+	while( p < end ) {
+		GC_CARD(p) = v;
+		p += GC_CARD_SIZE;
 	}
-	return memcmp(p,ZEROMEM,size) == 0;
 }
 
-static void gc_flush_empty_pages() {
+HL_API void hl_gc_write_barrier_range( void *ptr, int size ) {
+	gc_set_cards(ptr, size, 1);
+}
+
+// release an empty page, which the caller has removed from gc_pages
+static void gc_free_page( gc_pheader *p ) {
 	int i;
-	for(i=0;i<GC_ALL_PAGES;i++) {
-		gc_pheader *p = gc_pages[i];
-		gc_pheader *prev = NULL;
-		while( p ) {
-			gc_pheader *next = p->next_page;
-			if( p->bmp && is_zero(p->bmp+(p->first_block>>3),((p->max_blocks+7)>>3) - (p->first_block>>3)) ) {
-				int j;
-				gc_stats.pages_count--;
-				gc_stats.pages_blocks -= p->max_blocks;
-				gc_stats.pages_total_memory -= p->page_size;
-				gc_stats.mark_bytes -= (p->max_blocks + 7) >> 3;
-				if( prev )
-					prev->next_page = next;
-				else
-					gc_pages[i] = next;
-				if( gc_free_pages[i] == p )
-					gc_free_pages[i] = next;
-				for(j=0;j<p->page_size>>GC_MASK_BITS;j++) {
-					void *ptr = p->base + (j<<GC_MASK_BITS);
-					GC_GET_PAGE(ptr) = NULL;
-				}
-				gc_free_page_memory(p->base,p->page_size);
-				p->next_page = gc_free_pheaders;
-				gc_free_pheaders = p;
-			} else
-				prev = p;
-			p = next;
-		}
+	gc_stats.pages_count--;
+	gc_stats.pages_blocks -= p->max_blocks;
+	gc_stats.pages_total_memory -= p->page_size;
+	gc_pages_count[p->pid]--;
+	if( GC_IS_LARGE(p) ) {
+		gc_stats.large_count--;
+		gc_stats.large_memory -= p->page_size;
+	}
+	if( gc_free_pages[p->pid] == p )
+		gc_free_pages[p->pid] = p->next_page;
+	for(i=0;i<p->page_size>>GC_MASK_BITS;i++) {
+		void *ptr = p->base + (i<<GC_MASK_BITS);
+		GC_SET_PAGE(ptr,NULL);
 	}
+	// large objects memory goes back to the system at once
+	if( GC_IS_LARGE(p) )
+		gc_sys_free(p->base,p->page_size);
+	else
+		gc_free_page_memory(p->base,p->page_size);
+	p->next_page = gc_free_pheaders;
+	gc_free_pheaders = p;
 }
 
 #ifdef GC_DEBUG
@@ -400,6 +927,20 @@ static int PAGE_ID = 0;
 HL_API void hl_gc_dump_memory( const char *filename );
 static void gc_major( void );
 
+static struct {
+	int percent; // pages less occupied are compacted, 0 when disabled
+	bool active;
+	gc_pheader **pages;
+	int count;
+	int max;
+	gc_pheader *dest[GC_ALL_PAGES];
+	gc_pheader *next[GC_ALL_PAGES];
+	int64 moved;
+	int64 reclaimed;
+} gc_compact = {0};
+static void gc_mark_slice( bool complete );
+
+#ifndef GC_HEAP_RANGE
 static void *gc_will_collide( void *p, int size ) {
 #	ifdef HL_64
 	int i;
@@ -411,6 +952,31 @@ static void *gc_will_collide( void *p, int size ) {
 #	endif
 	return NULL;
 }
+#endif
+
+// block_mul = ceil(2^(bits+shift) / block_size) gives exact quotients for the offsets below 2^bits
+static void gc_init_block_index( gc_pheader *p ) {
+	int bits = 0, shift = 0;
+	while( (1 << shift) < p->block_size ) shift++;
+	if( p->max_blocks == 1 ) {
+		p->block_mul = 0;
+		p->block_shift = 0;
+	} else if( (1 << shift) == p->block_size ) {
+		p->block_mul = 1;
+		p->block_shift = shift;
+	} else {
+		while( bits < 31 && (1 << bits) < p->page_size ) bits++;
+		p->block_shift = bits + shift;
+		p->block_mul = ((((uint64)1) << p->block_shift) + p->block_size - 1) / p->block_size;
+	}
+}
+
+// index of the block starting at ptr, or -1 if ptr is inside a block
+static inline int gc_block_start( gc_pheader *p, void *ptr ) {
+	int off = (int)((unsigned char*)ptr - p->base);
+	int bid = GC_BLOCK_INDEX(p,off);
+	return bid * p->block_size == off ? bid : -1;
+}
 
 static gc_pheader *gc_alloc_new_page( int pid, int block, int size, int kind, bool varsize ) {
 	int m, i;
@@ -418,15 +984,11 @@ static gc_pheader *gc_alloc_new_page( int pid, int block, int size, int kind, bo
 	gc_pheader *p;
 	int start_pos;
 	int old_size = size;
+	bool zero = GC_SYS_ZERO;
 
 	// increase size based on previously allocated pages
 	if( block < 256 ) {
-		int num_pages = 0;
-		p = gc_pages[pid];
-		while( p ) {
-			num_pages++;
-			p = p->next_page;
-		}
+		int num_pages = gc_pages_count[pid];
 		while( num_pages > 8 && (size<<1) / block <= GC_PAGE_SIZE ) {
 			size <<= 1;
 			num_pages /= 3;
@@ -434,7 +996,8 @@ static gc_pheader *gc_alloc_new_page( int pid, int block, int size, int kind, bo
 	}
 
 retry:
-	base = (unsigned char*)gc_alloc_page_memory(size);
+	base = (unsigned char*)((pid >> PAGE_KIND_BITS) == GC_LARGE_PART ? gc_sys_alloc(size,true) : gc_alloc_page_memory(size,&zero));
+	if( !base && gc_compact.active ) return NULL;
 	if( !base ) {
 		int pages = gc_stats.pages_allocated;
 		gc_major();
@@ -452,7 +1015,7 @@ retry:
 	}
 	p = gc_alloc_page_header(base,size);
 
-#	ifdef HL_64
+#	if defined(HL_64) && !defined(GC_HEAP_RANGE)
 	void *ptr = gc_will_collide(p->base,size);
 	if( ptr ) {
 #		ifdef HL_VCC
@@ -467,18 +1030,25 @@ retry:
 #	if defined(GC_DEBUG)
 	memset(base,0xDD,size);
 	p->page_id = PAGE_ID++;
+	zero = false;
 #	else
 	// prevent false positive to access invalid type
-	if( kind == MEM_KIND_DYNAMIC ) memset(base, 0, size);
+	if( kind == MEM_KIND_DYNAMIC && !zero ) {
+		memset(base, 0, size);
+		zero = true;
+	}
 #	endif
 	if( ((int_val)base) & ((1<<GC_MASK_BITS) - 1) )
 		hl_fatal("Page memory is not correctly aligned");
 	p->page_size = size;
 	p->block_size = block;
 	p->page_kind = kind;
+	p->pid = pid;
+	p->next_free = NULL;
 	p->max_blocks = size / block;
+	p->zero_block = zero ? 0 : p->max_blocks;
+	gc_init_block_index(p);
 	p->sizes = NULL;
-	p->bmp = NULL;
 	start_pos = 0;
 	if( p->max_blocks > GC_PAGE_SIZE )
 		hl_fatal("Too many blocks for this page");
@@ -491,6 +1061,21 @@ retry:
 		}
 		MZERO(p->sizes,p->max_blocks);
 	}
+	// read by words, which can go past the bitmap end
+	if( p->max_blocks <= 32 )
+		p->bmp = (unsigned char*)&p->bmp_ref;
+	else {
+		start_pos = (start_pos + 3) & ~3;
+		p->bmp = base + start_pos;
+		start_pos += (p->max_blocks + 7) >> 3;
+	}
+	p->sweep_epoch = gc_sweep_epoch;
+	p->mark_epoch = gc_mark_epoch - 1;
+	if( gc_mark_phase ) {
+		MZERO(p->bmp,(p->max_blocks + 7) >> 3);
+		p->mark_epoch = gc_mark_epoch;
+		p->alloc_marked = true;
+	}
 	m = start_pos % block;
 	if( m ) start_pos += block - m;
 	p->first_block = start_pos / block;
@@ -501,150 +1086,234 @@ retry:
 	gc_stats.pages_allocated++;
 	gc_stats.pages_blocks += p->max_blocks;
 	gc_stats.pages_total_memory += size;
-	gc_stats.mark_bytes += (p->max_blocks + 7) >> 3;
+	if( GC_IS_LARGE(p) ) {
+		gc_stats.large_count++;
+		gc_stats.large_memory += size;
+	}
 
 	// register page in page map
 	p->next_page = gc_pages[pid];
 	gc_pages[pid] = p;
+	gc_pages_count[pid]++;
 	for(i=0;i<size>>GC_MASK_BITS;i++) {
 		void *ptr = p->base + (i<<GC_MASK_BITS);
+#		ifndef GC_HEAP_RANGE
 		if( GC_GET_LEVEL1(ptr) == gc_level1_null ) {
 			gc_pheader **level = (gc_pheader**)malloc(sizeof(void*) * (1<<GC_LEVEL1_BITS));
 			MZERO(level,sizeof(void*) * (1<<GC_LEVEL1_BITS));
 			GC_GET_LEVEL1(ptr) = level;
 		}
-		GC_GET_PAGE(ptr) = p;
+#		endif
+		GC_SET_PAGE(ptr,p);
 	}
 	return p;
 }
 
-static void *gc_alloc_fixed( int part, int kind ) {
-	int pid = (part << PAGE_KIND_BITS) | kind;
-	gc_pheader *p = gc_free_pages[pid];
-	unsigned char *ptr;
-	while( p ) {
-		if( p->bmp ) {
-			int next = p->next_block;
-			while( true ) {
-				unsigned int fetch_bits = ((unsigned int*)p->bmp)[next >> 5];
-				int ones = TRAILING_ONES(fetch_bits >> (next&31));
-				next += ones;
-				if( (next&31) == 0 && ones ) {
-					if( next >= p->max_blocks ) {
-						p->next_block = next;
-						break;
-					}
-					continue;
-				}
+static void gc_check_mark();
+
+static gc_local gc_unregistered_local = {{NULL}};
+
+static gc_local *gc_get_local() {
+	hl_thread_info *t = current_thread;
+	return t ? (gc_local*)t->gc_local : &gc_unregistered_local;
+}
+
+// the counters of unregistered threads are shared, and they can't take the global lock
+static inline void gc_local_count( gc_local *l, int64 *counter, int64 v ) {
+	if( l == &gc_unregistered_local )
+		ATOMIC_ADD64(counter, v);
+	else
+		*counter += v;
+}
+
+static gc_pheader **gc_local_page( int part, int pid ) {
+	hl_thread_info *t = current_thread;
+	if( !t || part >= GC_LOCAL_PARTS || (gc_flags & GC_FORCE_MAJOR) )
+		return NULL;
+	return ((gc_local*)t->gc_local)->pages + pid;
+}
+
+// called with the global lock held before looking for a new page
+static void gc_local_refill( gc_pheader **page ) {
+	gc_local *l = gc_get_local();
+	int64 requested = l->total_requested, allocated = l->total_allocated, count = l->allocation_count;
+	gc_stats.total_requested += requested;
+	gc_stats.total_allocated += allocated;
+	gc_stats.allocation_count += count;
+	l->thread_allocated += allocated;
+	gc_local_count(l, &l->total_requested, -requested);
+	gc_local_count(l, &l->total_allocated, -allocated);
+	gc_local_count(l, &l->allocation_count, -count);
+	if( page && *page ) {
+		(*page)->owner = NULL;
+		gc_free_index_add(*page);
+		*page = NULL;
+	}
+	gc_sweep_pages(GC_SWEEP_PAGES);
+	gc_check_mark();
+}
+
+// pages are swept the first time the allocator uses them after a collection
+static inline gc_pheader *gc_page_swept( gc_pheader *p ) {
+	if( p->sweep_epoch != gc_sweep_epoch ) {
+		gc_page_sweep(p);
+#		ifndef GC_DEBUG
+		// an empty page that needs cleared blocks is cleared at once instead of on each allocation
+		if( !GC_PAGE_MARKED(p) && MEM_HAS_PTR(p->page_kind) && p->zero_block > p->first_block ) {
+			MZERO(p->base + p->first_block * p->block_size, (p->zero_block - p->first_block) * p->block_size);
+			p->zero_block = p->first_block;
+		}
+#		endif
+	}
+	return p;
+}
+
+// pages that existed when an incremental mark started can't be reused before it completes
+#define GC_USABLE(p)	((p) && (!gc_mark_phase || (p)->alloc_marked))
+
+static int gc_run_bucket( int run, bool round_up ) {
+	int b = 5;
+	if( run < 32 ) return run;
+	while( (2 << b) <= run ) b++;
+	if( round_up && (1 << b) < run ) b++;
+	return b + 32 - 5;
+}
+
+static void gc_free_index_add( gc_pheader *p ) {
+	int b;
+	if( !p->sizes || p->free_blocks == 0 || !GC_USABLE(p) || p == gc_shared_pages[p->pid] ) return;
+	b = gc_run_bucket(p->free_blocks, false);
+	p->next_free = gc_free_runs[p->pid][b];
+	gc_free_runs[p->pid][b] = p;
+}
+
+static void gc_free_index_reset( int pid ) {
+	memset(gc_free_runs[pid], 0, sizeof(gc_free_runs[pid]));
+	gc_shared_pages[pid] = NULL;
+}
+
+static bool gc_fixed_find( gc_pheader *p ) {
+	int next;
+	if( !GC_PAGE_MARKED(p) )
+		return p->next_block < p->max_blocks;
+	next = p->next_block;
+	while( true ) {
+		unsigned int fetch_bits = ((unsigned int*)p->bmp)[next >> 5];
+		int ones = TRAILING_ONES(fetch_bits >> (next&31));
+		next += ones;
+		if( (next&31) == 0 && ones ) {
+			if( next >= p->max_blocks ) {
 				p->next_block = next;
-				if( next >= p->max_blocks )
-					break;
-				goto alloc_fixed;
+				return false;
 			}
-		} else if( p->next_block < p->max_blocks )
-			break;
-		p = p->next_page;
+			continue;
+		}
+		p->next_block = next;
+		return next < p->max_blocks;
 	}
-	if( p == NULL )
-		p = gc_alloc_new_page(pid, GC_SIZES[part], GC_PAGE_SIZE, kind, false);
-alloc_fixed:
-	ptr = p->base + p->next_block * p->block_size;
+}
+
+static void *gc_fixed_take( gc_pheader *p, bool *zero ) {
+	unsigned char *ptr = p->base + p->next_block * p->block_size;
 #	ifdef GC_DEBUG
 	{
 		int i;
 		if( p->next_block < p->first_block || p->next_block >= p->max_blocks )
 			hl_fatal("assert");
-		if( p->bmp && (p->bmp[p->next_block>>3]&(1<<(p->next_block&7))) != 0 )
+		if( GC_PAGE_MARKED(p) && (p->bmp[p->next_block>>3]&(1<<(p->next_block&7))) != 0 )
 			hl_fatal("Alloc on marked bit");
 		for(i=0;i<p->block_size;i++)
 			if( ptr[i] != 0xDD )
 				hl_fatal("assert");
 	}
 #	endif
+	if( p->alloc_marked ) p->bmp[p->next_block>>3] |= 1<<(p->next_block&7);
+	*zero = p->next_block >= p->zero_block;
+	if( *zero ) p->zero_block = p->next_block + 1;
 	p->next_block++;
-	gc_stats.total_allocated += p->block_size;
-	gc_free_pages[pid] = p;
 	return ptr;
 }
 
-static void *gc_alloc_var( int part, int size, int kind ) {
+static void *gc_alloc_fixed( int part, int kind, bool *zero ) {
 	int pid = (part << PAGE_KIND_BITS) | kind;
-	gc_pheader *p = gc_free_pages[pid];
-	unsigned char *ptr;
-	int nblocks = size >> GC_SBITS[part];
-	int max_free = gc_free_blocks[pid];
-loop:
-	while( p ) {
-		if( p->bmp ) {
-			int next, avail = 0;
-			if( p->free_blocks >= nblocks ) {
-				p->next_block = p->first_block;
-				p->free_blocks = 0;
-			}
-			next = p->next_block;
-			if( next + nblocks > p->max_blocks )
-				goto skip;
-			while( true ) {
-				int fid = next >> 5;
-				unsigned int fetch_bits = ((unsigned int*)p->bmp)[fid];
-				int bits;
+	gc_pheader **local = gc_local_page(part, pid);
+	gc_pheader *p;
+	void *ptr;
+	if( local && (p = *local) != NULL && gc_fixed_find(p) )
+		return gc_fixed_take(p,zero);
+	gc_global_lock(true);
+	gc_local_refill(local);
+	p = gc_free_pages[pid];
+	while( GC_USABLE(p) && (p->owner || !gc_fixed_find(gc_page_swept(p))) )
+		p = p->next_page;
+	if( !GC_USABLE(p) )
+		p = gc_alloc_new_page(pid, GC_SIZES[part], GC_PAGE_SIZE, kind, false);
+	gc_free_pages[pid] = p;
+	if( local ) {
+		p->owner = current_thread;
+		*local = p;
+	}
+	ptr = gc_fixed_take(p,zero);
+	gc_global_lock(false);
+	return ptr;
+}
+
+static bool gc_var_find( gc_pheader *p, int nblocks ) {
+	int next, avail = 0;
+	if( !GC_PAGE_MARKED(p) )
+		return p->next_block + nblocks <= p->max_blocks;
+	if( p->free_blocks >= nblocks ) {
+		p->next_block = p->first_block;
+		p->free_blocks = 0;
+	}
+	next = p->next_block;
+	if( next + nblocks > p->max_blocks )
+		return false;
+	while( true ) {
+		int fid = next >> 5;
+		unsigned int fetch_bits = ((unsigned int*)p->bmp)[fid];
+		int bits;
 resume:
-				bits = TRAILING_ONES(fetch_bits >> (next&31));
-				if( bits ) {
-					if( avail > p->free_blocks ) p->free_blocks = avail;
-					avail = 0;
-					next += bits - 1;
-					if( next >= p->max_blocks ) {
-						p->next_block = next;
-						p = p->next_page;
-						goto loop;
-					}
-					if( p->sizes[next] == 0 ) hl_fatal("assert");
-					next += p->sizes[next];
-					if( next + nblocks > p->max_blocks ) {
-						p->next_block = next;
-						p = p->next_page;
-						goto loop;
-					}
-					if( (next>>5) != fid )
-						continue;
-					goto resume;
-				}
-				bits = TRAILING_ZEROES( (next & 31) ? (fetch_bits >> (next&31)) | (1<<(32-(next&31))) : fetch_bits );
-				avail += bits;
-				next += bits;
-				if( next > p->max_blocks ) {
-					avail -= next - p->max_blocks;
-					next = p->max_blocks;
-					if( avail < nblocks ) break;
-				}
-				if( avail >= nblocks ) {
-					p->next_block = next - avail;
-					goto alloc_var;
-				}
-				if( next & 31 ) goto resume;
-			}
+		bits = TRAILING_ONES(fetch_bits >> (next&31));
+		if( bits ) {
 			if( avail > p->free_blocks ) p->free_blocks = avail;
-			p->next_block = next;
-		} else if( p->next_block + nblocks <= p->max_blocks )
-			break;
-skip:
-		if( p->free_blocks > max_free )
-			max_free = p->free_blocks;
-		p = p->next_page;
-		if( p == NULL && max_free >= nblocks ) {
-			max_free = 0;
-			p = gc_pages[pid];
+			avail = 0;
+			next += bits - 1;
+			if( next >= p->max_blocks ) {
+				p->next_block = next;
+				return false;
+			}
+			if( p->sizes[next] == 0 ) hl_fatal("assert");
+			next += p->sizes[next];
+			if( next + nblocks > p->max_blocks ) {
+				p->next_block = next;
+				return false;
+			}
+			if( (next>>5) != fid )
+				continue;
+			goto resume;
 		}
+		bits = TRAILING_ZEROES( (next & 31) ? (fetch_bits >> (next&31)) | (1<<(32-(next&31))) : fetch_bits );
+		avail += bits;
+		next += bits;
+		if( next > p->max_blocks ) {
+			avail -= next - p->max_blocks;
+			next = p->max_blocks;
+			if( avail < nblocks ) break;
+		}
+		if( avail >= nblocks ) {
+			p->next_block = next - avail;
+			return true;
+		}
+		if( next & 31 ) goto resume;
 	}
-	if( p == NULL ) {
-		int psize = GC_PAGE_SIZE;
-		while( psize < size + 1024 )
-			psize <<= 1;
-		p = gc_alloc_new_page(pid, GC_SIZES[part], psize, kind, true);
-	}
-alloc_var:
-	ptr = p->base + p->next_block * p->block_size;
+	if( avail > p->free_blocks ) p->free_blocks = avail;
+	p->next_block = next;
+	return false;
+}
+
+static void *gc_var_take( gc_pheader *p, int nblocks, int size, bool *zero ) {
+	unsigned char *ptr = p->base + p->next_block * p->block_size;
 #	ifdef GC_DEBUG
 	{
 		int i;
@@ -655,7 +1324,7 @@ alloc_var:
 				hl_fatal("assert");
 	}
 #	endif
-	if( p->bmp ) {
+	if( GC_PAGE_MARKED(p) ) {
 		int bid = p->next_block;
 #		ifdef GC_DEBUG
 		int i;
@@ -666,134 +1335,517 @@ alloc_var:
 		bid = p->next_block;
 #		endif
 		p->bmp[bid>>3] |= 1<<(bid&7);
+		// the next minor collection will see this block as old, make sure it gets scanned
+		if( gc_generational && MEM_HAS_PTR(p->page_kind) )
+			gc_set_cards(ptr, nblocks * p->block_size, 1);
 	} else {
 		p->free_blocks = p->max_blocks - (p->next_block + nblocks);
 	}
 	if( nblocks > 1 ) MZERO(p->sizes + p->next_block, nblocks);
 	p->sizes[p->next_block] = (unsigned char)nblocks;
+	*zero = p->next_block >= p->zero_block;
 	p->next_block += nblocks;
-	gc_stats.total_allocated += size + 1;
-	gc_free_pages[pid] = p;
-	gc_free_blocks[pid] = max_free;
+	if( p->next_block > p->zero_block ) p->zero_block = p->next_block;
+	return ptr;
+}
+
+// find a page with a free run of nblocks : the indexed pages are scanned again only if their
+// largest run is big enough, the others are scanned once per collection and then indexed
+static gc_pheader *gc_var_page( int pid, int nblocks ) {
+	gc_pheader *p;
+	int b;
+	for(b=gc_run_bucket(nblocks,true);b<GC_RUN_BUCKETS;b++)
+		while( (p = gc_free_runs[pid][b]) != NULL ) {
+			gc_free_runs[pid][b] = p->next_free;
+			if( gc_var_find(p,nblocks) )
+				return p;
+			// the scan was complete, this files it in a lower bucket
+			gc_free_index_add(p);
+		}
+	while( GC_USABLE(p = gc_free_pages[pid]) ) {
+		gc_free_pages[pid] = p->next_page;
+		if( p->owner ) continue;
+		if( gc_var_find(gc_page_swept(p),nblocks) )
+			return p;
+		gc_free_index_add(p);
+	}
+	return NULL;
+}
+
+static void *gc_alloc_var( int part, int size, int kind, bool *zero ) {
+	int pid = (part << PAGE_KIND_BITS) | kind;
+	gc_pheader **local = gc_local_page(part, pid);
+	gc_pheader *p;
+	void *ptr;
+	int nblocks = size >> GC_SBITS[part];
+	if( local && (p = *local) != NULL && gc_var_find(p,nblocks) )
+		return gc_var_take(p,nblocks,size,zero);
+	gc_global_lock(true);
+	gc_local_refill(local);
+	p = local ? NULL : gc_shared_pages[pid];
+	if( p && !gc_var_find(p,nblocks) ) {
+		gc_shared_pages[pid] = NULL;
+		gc_free_index_add(p);
+		p = NULL;
+	}
+	if( !p ) p = gc_var_page(pid,nblocks);
+	if( !p ) {
+		int psize = GC_PAGE_SIZE;
+		while( psize < size + 1024 )
+			psize <<= 1;
+		p = gc_alloc_new_page(pid, GC_SIZES[part], psize, kind, true);
+	}
+	if( local ) {
+		p->owner = current_thread;
+		*local = p;
+	} else
+		gc_shared_pages[pid] = p;
+	ptr = gc_var_take(p,nblocks,size,zero);
+	gc_global_lock(false);
 	return ptr;
 }
 
-static void *gc_alloc_gen( int size, int flags, int *allocated ) {
+static void *gc_alloc_large( int size, int kind, bool *zero ) {
+	int pid = (GC_LARGE_PART << PAGE_KIND_BITS) | kind;
+	int psize;
+	gc_pheader *p;
+	void *ptr;
+	if( size > INT_MAX - GC_PAGE_SIZE ) hl_error("Required memory allocation too big");
+	psize = (size + GC_PAGE_SIZE - 1) & ~(GC_PAGE_SIZE - 1);
+	gc_global_lock(true);
+	gc_local_refill(NULL);
+	p = gc_alloc_new_page(pid, psize, psize, kind, false);
+	ptr = gc_fixed_take(p,zero);
+	gc_global_lock(false);
+	return ptr;
+}
+
+// zero is set when the returned block is known to be cleared
+static void *gc_alloc_gen( int size, int flags, int *allocated, bool *zero ) {
 	int m = size & (GC_ALIGN - 1);
 	int p;
-	gc_stats.allocation_count++;
-	gc_stats.total_requested += size;
+	gc_local *l = gc_get_local();
+	void *ptr;
+	gc_local_count(l, &l->allocation_count, 1);
+	gc_local_count(l, &l->total_requested, size);
+	if( size > INT_MAX - GC_ALIGN ) hl_error("Required memory allocation too big");
 	if( m ) size += GC_ALIGN - m;
 	if( size <= 0 ) {
 		*allocated = 0;
 		return NULL;
 	}
 	if( size <= GC_SIZES[GC_FIXED_PARTS-1] && (flags & MEM_ALIGN_DOUBLE) == 0 && flags != MEM_KIND_FINALIZER ) {
+		ptr = gc_alloc_fixed( (size >> GC_ALIGN_BITS) - 1, flags & PAGE_KIND_MASK, zero);
+		*allocated = size;
+		gc_local_count(l, &l->total_allocated, size);
+		return ptr;
+	}
+	if( size >= GC_LARGE_SIZE ) {
+		ptr = gc_alloc_large(size, flags & PAGE_KIND_MASK, zero);
 		*allocated = size;
-		return gc_alloc_fixed( (size >> GC_ALIGN_BITS) - 1, flags & PAGE_KIND_MASK);
+		gc_local_count(l, &l->total_allocated, size);
+		return ptr;
 	}
-	for(p=GC_FIXED_PARTS;p<GC_PARTITIONS;p++) {
+	for(p=GC_FIXED_PARTS;p<GC_LARGE_PART;p++) {
 		int block = GC_SIZES[p];
 		int query = size;
 		int m = query & (block - 1);
 		if( m ) query += block - m;
 		if( query < block * 255 ) {
-			void *ptr = gc_alloc_var(p, query, flags & PAGE_KIND_MASK);
+			ptr = gc_alloc_var(p, query, flags & PAGE_KIND_MASK, zero);
 			*allocated = query;
+			gc_local_count(l, &l->total_allocated, query + 1);
 			return ptr;
 		}
 	}
-	gc_global_lock(false);
 	hl_error("Required memory allocation too big");
 	return NULL;
 }
 
-static void gc_check_mark();
-
 void *hl_gc_alloc_gen( hl_type *t, int size, int flags ) {
 	void *ptr;
-	int time = 0;
+	int64 time = 0;
 	int allocated = 0;
-	gc_global_lock(true);
-	gc_check_mark();
+	bool zero = false;
+	if( flags & MEM_ARENA ) {
+		hl_arena *a = gc_get_local()->arena;
+		if( a && size > 0 && (flags & MEM_ALIGN_DOUBLE) == 0 && (flags & PAGE_KIND_MASK) != MEM_KIND_FINALIZER ) {
+			allocated = size + hl_pad_size(size,&hlt_dyn);
+			ptr = hl_malloc(&a->alloc,allocated);
+			a->size += allocated;
+			if( flags & MEM_ZERO ) MZERO(ptr,allocated);
+			hl_track_call(HL_TRACK_ALLOC, on_alloc(t,size,flags,ptr));
+			return ptr;
+		}
+	}
 #	ifdef GC_MEMCHK
 	size += HL_WSIZE;
 #	endif
-	if( gc_flags & GC_PROFILE ) time = TIMESTAMP();
-	ptr = gc_alloc_gen(size, flags, &allocated);
-	if( gc_flags & GC_PROFILE ) gc_stats.alloc_time += TIMESTAMP() - time;
+	if( gc_flags & GC_PROFILE ) time = gc_clock();
+	ptr = gc_alloc_gen(size, flags, &allocated, &zero);
+	if( gc_flags & GC_PROFILE ) gc_stats.alloc_time += gc_clock() - time;
 #	ifdef GC_DEBUG
 	memset(ptr,0xCD,allocated);
 #	endif
-	if( flags & MEM_ZERO )
+	if( zero ) {
+		// already cleared
+	} else if( flags & MEM_ZERO )
 		MZERO(ptr,allocated);
 	else if( MEM_HAS_PTR(flags) && allocated != size )
 		MZERO((char*)ptr+size,allocated-size); // erase possible pointers after data
 #	ifdef GC_MEMCHK
 	memset((char*)ptr+(allocated - HL_WSIZE),0xEE,HL_WSIZE);
 #	endif
-	gc_global_lock(false);
 	hl_track_call(HL_TRACK_ALLOC, on_alloc(t,size,flags,ptr));
 	return ptr;
 }
 
 // -------------------------  MARKING ----------------------------------------------------------
 
-static float gc_mark_threshold = 0.2f;
-static int mark_size = 0;
-static unsigned char *mark_data = NULL;
-static void **cur_mark_stack = NULL;
-static void **mark_stack_end = NULL;
-static int mark_stack_size = 0;
+static float gc_retain_ratio = 0.25f;
+
+// pacing : a collection starts once the memory allocated since the last one reaches growth% of
+// the live heap, estimated by the pages memory when the last sweep completed (at least 4MB).
+// with a soft limit, the allowed growth shrinks to the room left below it, down to 1/64 of the limit
+#define GC_PACER_MIN_HEAP	(4 << 20)
+#define GC_PACER_GROWTH		20
+#define GC_PACER_MAX_BUDGET	(LLONG_MAX >> 2) // leaves room to compare against twice the budget
+
+typedef enum {
+	GC_TRIGGER_GROWTH,
+	GC_TRIGGER_COUNT,
+	GC_TRIGGER_LIMIT,
+	GC_TRIGGER_FORCED,
+	GC_TRIGGERS
+} gc_trigger;
+
+static const char *gc_trigger_names[GC_TRIGGERS] = { "growth", "count", "limit", "forced" };
+
+static struct {
+	int growth; // percent, < 0 : only collect near the limit
+	int64 limit; // bytes, 0 if none
+	int64 live;
+	int64 budget; // as computed by the last check
+	bool limited;
+	gc_trigger last;
+	int counts[GC_TRIGGERS];
+} gc_pacer = { GC_PACER_GROWTH };
+
+// only collecting near the limit requires one, or the heap would grow without bound
+static int gc_pacer_growth() {
+	return gc_pacer.growth < 0 && !gc_pacer.limit ? GC_PACER_GROWTH : gc_pacer.growth;
+}
+
+// a growth of 0 would collect on every check : it is raised to 1%
+static void gc_pacer_set( int growth, double limit ) {
+	gc_pacer.growth = growth < 0 ? -1 : (growth == 0 ? 1 : growth);
+	gc_pacer.limit = !(limit > 0) ? 0 : (limit >= (double)GC_PACER_MAX_BUDGET ? GC_PACER_MAX_BUDGET : (int64)limit);
+}
+
+// v * percent / 100, saturated
+static int64 gc_pacer_scale( int64 v, int percent ) {
+	if( percent > 0 && v > GC_PACER_MAX_BUDGET / percent ) return GC_PACER_MAX_BUDGET;
+	return v * percent / 100;
+}
+
+static int64 gc_pacer_budget() {
+	int64 live = gc_pacer.live < GC_PACER_MIN_HEAP ? GC_PACER_MIN_HEAP : gc_pacer.live;
+	int growth = gc_pacer_growth();
+	int64 budget = growth < 0 ? -1 : gc_pacer_scale(live, growth);
+	gc_pacer.limited = false;
+	if( gc_pacer.limit ) {
+		int64 room = gc_pacer.limit - live;
+		if( room < (gc_pacer.limit >> 6) ) room = gc_pacer.limit >> 6;
+		if( budget < 0 || budget > room ) {
+			budget = room;
+			gc_pacer.limited = true;
+		}
+	}
+	gc_pacer.budget = budget;
+	return budget;
+}
+
+typedef struct {
+	hl_type *t;
+	int64 count;
+	int64 bytes;
+} gc_census_entry;
+
+typedef struct {
+	void **stack;
+	void **cur;
+	void **end;
+	int64 scanned; // words examined during the current mark
+	gc_census_entry *census; // open addressing by type
+	int census_size;
+	int census_count;
+#	ifdef GC_PARALLEL
+	// part of the stack that other mark threads can steal
+	gc_mutex lock;
+	void **shared;
+	volatile int shared_count;
+	int shared_max;
+	gc_sem start;
+#	endif
+} gc_mark_thread;
+
+// the collecting thread always uses gc_mark_threads[0]
+static gc_mark_thread *gc_mark_threads = NULL;
+static int gc_mark_threads_count = 1;
+static bool gc_mark_parallel = false;
+#ifdef GC_PARALLEL
+static bool gc_mark_helpers_started = false;
+static volatile int gc_mark_active = 0;
+static gc_sem gc_mark_done;
+#	define GC_SHARE_MIN	64
+#endif
 
 #define GC_PUSH_GEN(ptr,page) \
 	if( MEM_HAS_PTR((page)->page_kind) ) { \
-		if( mark_stack == mark_stack_end ) mark_stack = hl_gc_mark_grow(mark_stack); \
+		if( mark_stack == m->end ) mark_stack = gc_mark_grow(m,mark_stack); \
 		*mark_stack++ = ptr; \
 	}
 
-HL_PRIM void **hl_gc_mark_grow( void **stack ) {
-	int nsize = mark_stack_size ? (((mark_stack_size * 3) >> 1) & ~1) : 256;
+#define GC_CLAIM(page)	(ATOMIC_LOAD(&(page)->mark_epoch) == gc_mark_epoch || gc_page_claim(page))
+
+#define GC_MARK_BIT(page,bid) \
+	(GC_CLAIM(page) && ((page)->bmp[(bid)>>3] & (1<<((bid)&7))) == 0 && gc_set_mark((page)->bmp + ((bid)>>3),1<<((bid)&7)))
+
+// clear the bitmap of a page reached for the first time in this major cycle
+static bool gc_page_claim( gc_pheader *p ) {
+#	ifdef GC_PARALLEL
+	if( gc_mark_parallel ) {
+		int epoch = ATOMIC_LOAD(&p->mark_epoch);
+		if( epoch != gc_mark_epoch && epoch != GC_EPOCH_BUSY && ATOMIC_CAS(&p->mark_epoch,epoch,GC_EPOCH_BUSY) ) {
+			MZERO(p->bmp,(p->max_blocks + 7) >> 3);
+			ATOMIC_FENCE();
+			p->mark_epoch = gc_mark_epoch;
+		} else {
+			// another mark thread is clearing it
+			while( ATOMIC_LOAD(&p->mark_epoch) != gc_mark_epoch ) {}
+		}
+		return true;
+	}
+#	endif
+	MZERO(p->bmp,(p->max_blocks + 7) >> 3);
+	p->mark_epoch = gc_mark_epoch;
+	return true;
+}
+
+// returns false if another mark thread has set the bit before us
+static inline bool gc_set_mark( unsigned char *b, int bit ) {
+#	ifdef GC_PARALLEL
+	if( gc_mark_parallel )
+		return (ATOMIC_OR8(b,bit) & bit) == 0;
+#	endif
+	*b |= bit;
+	return true;
+}
+
+static void **gc_mark_grow( gc_mark_thread *m, void **stack ) {
+	int size = (int)(m->end - m->stack);
+	int nsize = size ? (((size * 3) >> 1) & ~1) : 256;
 	void **nstack = (void**)malloc(sizeof(void**) * nsize);
-	void **base_stack = mark_stack_end - mark_stack_size;
-	int avail = (int)(stack - base_stack);
+	int avail = (int)(stack - m->stack);
 	if( nstack == NULL ) {
 		out_of_memory("markstack");
 		return NULL;
 	}
-	memcpy(nstack, base_stack, avail * sizeof(void*));
-	free(base_stack);
-	mark_stack_size = nsize;
-	mark_stack_end = nstack + nsize;
-	cur_mark_stack = nstack + avail;
-	if( avail == 0 )
-		*cur_mark_stack++ = 0;
-	return cur_mark_stack;
+	memcpy(nstack, m->stack, avail * sizeof(void*));
+	free(m->stack);
+	m->stack = nstack;
+	m->end = nstack + nsize;
+	m->cur = nstack + avail;
+	return m->cur;
 }
 
-#define GC_PRECISE
+#ifdef GC_PARALLEL
+// give the bottom half of our stack to starving mark threads
+static void **gc_mark_share( gc_mark_thread *m, void **stack ) {
+	int count = (int)(stack - m->stack) >> 1;
+	gc_mutex_lock(&m->lock);
+	if( m->shared_count == 0 ) {
+		if( count > m->shared_max ) {
+			free(m->shared);
+			m->shared_max = count;
+			m->shared = (void**)malloc(sizeof(void*) * count);
+			if( m->shared == NULL ) out_of_memory("markstack");
+		}
+		memcpy(m->shared, m->stack, count * sizeof(void*));
+		memmove(m->stack, m->stack + count, (stack - (m->stack + count)) * sizeof(void*));
+		stack -= count;
+		m->shared_count = count;
+	}
+	gc_mutex_unlock(&m->lock);
+	return stack;
+}
 
-static void gc_flush_mark() {
-	register void **mark_stack = cur_mark_stack;
+static bool gc_mark_steal( gc_mark_thread *m ) {
+	int i, id = (int)(m - gc_mark_threads);
+	for(i=0;i<gc_mark_threads_count;i++) {
+		gc_mark_thread *v = gc_mark_threads + ((id + i) % gc_mark_threads_count);
+		void **mark_stack;
+		int count;
+		if( v->shared_count == 0 ) continue;
+		gc_mutex_lock(&v->lock);
+		count = v->shared_count;
+		if( count == 0 ) {
+			gc_mutex_unlock(&v->lock);
+			continue;
+		}
+		mark_stack = m->cur;
+		while( m->end - mark_stack < count )
+			mark_stack = gc_mark_grow(m, mark_stack);
+		memcpy(mark_stack, v->shared, count * sizeof(void*));
+		m->cur = mark_stack + count;
+		v->shared_count = 0;
+		gc_mutex_unlock(&v->lock);
+		return true;
+	}
+	return false;
+}
+#endif
+
+// census : every Nth major collection, the live dynamic blocks are counted by type
+// while they are scanned. the tables of the mark threads are merged when the mark ends
+static struct {
+	int every; // 0 if disabled
+	int majors;
+	bool active;
+	gc_census_entry *result; // by decreasing bytes
+	int count;
+	int collection;
+} gc_census = {0};
+
+// the mark of a heap snapshot is not a collection : it doesn't count towards the census
+// and doesn't record a pause or phase times
+static bool gc_snapshot_mark = false;
+
+static void gc_census_grow( gc_mark_thread *m ) {
+	gc_census_entry *old = m->census;
+	int i, osize = m->census_size;
+	m->census_size = osize ? osize << 1 : 1024;
+	m->census = (gc_census_entry*)calloc(m->census_size, sizeof(gc_census_entry));
+	if( m->census == NULL ) out_of_memory("census");
+	m->census_count = 0;
+	for(i=0;i<osize;i++) {
+		gc_census_entry *e = old + i;
+		if( e->count == 0 ) continue;
+		int h = (int)(((uint64)(int_val)e->t * 0x9E3779B97F4A7C15ULL) >> 40) & (m->census_size - 1);
+		while( m->census[h].count )
+			h = (h + 1) & (m->census_size - 1);
+		m->census[h] = *e;
+		m->census_count++;
+	}
+	free(old);
+}
+
+static void gc_census_add( gc_mark_thread *m, hl_type *t, int64 count, int64 bytes ) {
+	gc_census_entry *e;
+	int h;
+	if( (m->census_count + 1) * 4 > m->census_size * 3 )
+		gc_census_grow(m);
+	h = (int)(((uint64)(int_val)t * 0x9E3779B97F4A7C15ULL) >> 40) & (m->census_size - 1);
+	while( m->census[h].count && m->census[h].t != t )
+		h = (h + 1) & (m->census_size - 1);
+	e = m->census + h;
+	if( e->count == 0 ) {
+		e->t = t;
+		m->census_count++;
+	}
+	e->count += count;
+	e->bytes += bytes;
+}
+
+static int gc_census_cmp( const void *a, const void *b ) {
+	int64 x = ((gc_census_entry*)a)->bytes, y = ((gc_census_entry*)b)->bytes;
+	return x > y ? -1 : (x < y ? 1 : 0);
+}
+
+static void gc_census_merge() {
+	gc_mark_thread *m0 = gc_mark_threads;
+	int i, j;
+	for(i=1;i<gc_mark_threads_count;i++) {
+		gc_mark_thread *m = gc_mark_threads + i;
+		for(j=0;j<m->census_size;j++)
+			if( m->census[j].count ) {
+				gc_census_add(m0, m->census[j].t, m->census[j].count, m->census[j].bytes);
+				m->census[j].count = m->census[j].bytes = 0;
+			}
+		m->census_count = 0;
+	}
+	free(gc_census.result);
+	gc_census.result = (gc_census_entry*)malloc(sizeof(gc_census_entry) * (m0->census_count + 1));
+	if( gc_census.result == NULL ) out_of_memory("census");
+	gc_census.count = 0;
+	for(j=0;j<m0->census_size;j++)
+		if( m0->census[j].count ) {
+			gc_census.result[gc_census.count++] = m0->census[j];
+			m0->census[j].count = m0->census[j].bytes = 0;
+		}
+	m0->census_count = 0;
+	qsort(gc_census.result, gc_census.count, sizeof(gc_census_entry), gc_census_cmp);
+	gc_census.collection = gc_stats.mark_count + 1;
+	gc_census.active = false;
+}
+
+#define GC_PREFETCH	8 // blocks popped ahead of their scan, must be a power of 2
+
+// scans at most budget blocks, or until the stack is empty if budget is 0.
+// blocks are popped and prefetched a few scans before their turn so their memory is in cache
+static void gc_flush_mark( gc_mark_thread *m, int budget ) {
+	register void **mark_stack = m->cur;
+	void *fifo[GC_PREFETCH];
+	int head = 0, queued = 0, count = 0;
+	int64 scanned = 0;
+	// consecutive blocks often have the same type : they are added to the census at once
+	hl_type *census_t = NULL;
+	int64 census_count = 0, census_bytes = 0;
 	while( true ) {
-		void **block = (void**)*--mark_stack;
-		gc_pheader *page = GC_GET_PAGE(block);
+		void **block;
+		gc_pheader *page;
 		unsigned int *mark_bits = NULL;
-		int pos = 0, size, nwords;
+		int pos = 0, size, nwords, bid;
+		while( queued < GC_PREFETCH && mark_stack > m->stack ) {
+			void *b = *--mark_stack;
+			PREFETCH(b);
+			fifo[(head + queued++) & (GC_PREFETCH - 1)] = b;
+		}
+		if( queued == 0 ) break;
+		if( budget && count++ == budget ) {
+			while( queued > 0 )
+				*mark_stack++ = fifo[(head + --queued) & (GC_PREFETCH - 1)];
+			break;
+		}
+		block = (void**)fifo[head];
+		head = (head + 1) & (GC_PREFETCH - 1);
+		queued--;
+		page = GC_GET_PAGE(block);
 #		ifdef GC_DEBUG
 		vdynamic *ptr = (vdynamic*)block;
 		ptr += 0; // prevent unreferenced warning
 #		endif
-		if( !block ) {
-			mark_stack++;
-			break;
-		}
-		int bid = (int)(((unsigned char*)block) - page->base) / page->block_size;
+#		ifdef GC_PARALLEL
+		if( gc_mark_parallel && gc_mark_active < gc_mark_threads_count && mark_stack - m->stack >= GC_SHARE_MIN && m->shared_count == 0 )
+			mark_stack = gc_mark_share(m, mark_stack);
+#		endif
+		bid = GC_BLOCK_INDEX(page,((unsigned char*)block) - page->base);
 		size = page->sizes ? page->sizes[bid] * page->block_size : page->block_size;
 #		ifdef GC_DEBUG
 		if( size == 0 ) hl_fatal("assert");
 #		endif
 		nwords = size / HL_WSIZE;
+		scanned += nwords;
+		if( gc_census.active && page->page_kind == MEM_KIND_DYNAMIC ) {
+			hl_type *t = *(hl_type**)block;
+			if( t != census_t ) {
+				if( census_count ) gc_census_add(m, census_t, census_count, census_bytes);
+				census_t = t;
+				census_count = census_bytes = 0;
+			}
+			census_count++;
+			census_bytes += size;
+		}
 #		ifdef GC_PRECISE
 		if( page->page_kind == MEM_KIND_DYNAMIC ) {
 			hl_type *t = *(hl_type**)block;
@@ -827,192 +1879,1069 @@ static void gc_flush_mark() {
 			p = *block++;
 			pos++;
 			page = GC_GET_PAGE(p);
-			if( !page || !INPAGE(p,page) || ((((unsigned char*)p - page->base))%page->block_size) != 0 ) continue;
-			bid = (int)((unsigned char*)p - page->base) / page->block_size;
+			if( !page || !INPAGE(p,page) || (bid = gc_block_start(page,p)) < 0 ) continue;
 			if( page->sizes ) {
 				if( page->sizes[bid] == 0 ) continue;
 			} else if( bid < page->first_block )
 				continue;
-			if( (page->bmp[bid>>3] & (1<<(bid&7))) == 0 ) {
-				page->bmp[bid>>3] |= 1<<(bid&7);
+			if( GC_MARK_BIT(page,bid) )
 				GC_PUSH_GEN(p,page);
-			}
 		}
 	}
-	cur_mark_stack = mark_stack;
+	if( census_count ) gc_census_add(m, census_t, census_count, census_bytes);
+	m->cur = mark_stack;
+	m->scanned += scanned;
 }
 
 #ifdef GC_DEBUG
-static void gc_clear_unmarked_mem() {
+static void gc_clear_unmarked_mem( gc_pheader *p ) {
+	bool marked = GC_PAGE_MARKED(p);
+	int bid;
+	for(bid=p->first_block;bid<p->max_blocks;bid++) {
+		if( p->sizes && !p->sizes[bid] ) continue;
+		int size = p->sizes ? p->sizes[bid] * p->block_size : p->block_size;
+		unsigned char *ptr = p->base + bid * p->block_size;
+		if( bid * p->block_size + size > p->page_size ) hl_fatal("invalid block size");
+#		ifdef GC_MEMCHK
+		int_val eob = *(int_val*)(ptr + size - HL_WSIZE);
+#		ifdef HL_64
+		if( eob != 0xEEEEEEEEEEEEEEEE && eob != 0xDDDDDDDDDDDDDDDD )
+#		else
+		if( eob != 0xEEEEEEEE && eob != 0xDDDDDDDD )
+#		endif
+			hl_fatal("Block written out of bounds");
+#		endif
+		if( !marked || (p->bmp[bid>>3] & (1<<(bid&7))) == 0 ) {
+			memset(ptr,0xDD,size);
+			if( p->sizes ) p->sizes[bid] = 0;
+		}
+	}
+}
+#endif
+
+#ifdef GC_PARALLEL
+// dead finalizable blocks are queued during the collection and kept alive until
+// their finalizer has run on a separate thread, which then clears it
+typedef struct {
+	void **items;
+	int count;
+	int max;
+} gc_fqueue;
+
+static struct {
+	gc_mutex lock;
+	gc_cond wake;
+	gc_cond done;
+	gc_fqueue pending;
+	gc_fqueue running;
+	bool started;
+} gc_finalizers;
+
+static void gc_mark_stack( gc_mark_thread *m, void *start, void *end, bool native );
+
+// finalizer blocks are not typed : the queued ones are kept with what their words reference
+static void gc_finalizers_keep( gc_mark_thread *m, gc_fqueue *q, int start ) {
 	int i;
-	for(i=0;i<GC_ALL_PAGES;i++) {
-		gc_pheader *p = gc_pages[i];
-		while( p ) {
-			int bid;
-			for(bid=p->first_block;bid<p->max_blocks;bid++) {
-				if( p->sizes && !p->sizes[bid] ) continue;
-				int size = p->sizes ? p->sizes[bid] * p->block_size : p->block_size;
-				unsigned char *ptr = p->base + bid * p->block_size;
-				if( bid * p->block_size + size > p->page_size ) hl_fatal("invalid block size");
-#				ifdef GC_MEMCHK
-				int_val eob = *(int_val*)(ptr + size - HL_WSIZE);
-#				ifdef HL_64
-				if( eob != 0xEEEEEEEEEEEEEEEE && eob != 0xDDDDDDDDDDDDDDDD )
-#				else
-				if( eob != 0xEEEEEEEE && eob != 0xDDDDDDDD )
-#				endif
-					hl_fatal("Block written out of bounds");
-#				endif
-				if( (p->bmp[bid>>3] & (1<<(bid&7))) == 0 ) {
-					memset(ptr,0xDD,size);
-					if( p->sizes ) p->sizes[bid] = 0;
-				}
+	for(i=start;i<q->count;i++) {
+		unsigned char *ptr = (unsigned char*)q->items[i];
+		gc_pheader *p = GC_GET_PAGE(ptr);
+		int bid = GC_BLOCK_INDEX(p,ptr - p->base);
+		if( !GC_PAGE_MARKED(p) ) gc_page_claim(p);
+		p->bmp[bid>>3] |= 1<<(bid&7);
+		gc_mark_stack(m, ptr, ptr + p->sizes[bid] * p->block_size, false);
+	}
+}
+
+static void gc_finalizers_push( void *ptr ) {
+	gc_fqueue *q = &gc_finalizers.pending;
+	if( q->count == q->max ) {
+		int nmax = q->max ? q->max << 1 : 256;
+		void **items = (void**)realloc(q->items, sizeof(void*) * nmax);
+		if( items == NULL ) out_of_memory("finalizers");
+		q->items = items;
+		q->max = nmax;
+	}
+	q->items[q->count++] = ptr;
+}
+
+static void gc_finalizer_loop( void *unused ) {
+	gc_fqueue q;
+	int i;
+	hl_register_thread(&q);
+	hl_get_thread()->flags |= HL_THREAD_INVISIBLE;
+	// a finalizer can allocate, so a collection has to wait for the one running
+	hl_blocking(true);
+	gc_mutex_lock(&gc_finalizers.lock);
+	while( true ) {
+		while( gc_finalizers.pending.count == 0 )
+			gc_cond_wait(&gc_finalizers.wake,&gc_finalizers.lock);
+		q = gc_finalizers.running;
+		gc_finalizers.running = gc_finalizers.pending;
+		gc_finalizers.pending = q;
+		gc_mutex_unlock(&gc_finalizers.lock);
+		for(i=0;i<gc_finalizers.running.count;i++) {
+			void **ptr = (void**)gc_finalizers.running.items[i];
+			hl_blocking(false);
+			((void(*)(void *))*ptr)(ptr);
+			*ptr = NULL;
+			hl_blocking(true);
+		}
+		gc_mutex_lock(&gc_finalizers.lock);
+		gc_finalizers.running.count = 0;
+		gc_cond_broadcast(&gc_finalizers.done);
+	}
+}
+
+// with the finalizers lock held
+static void gc_finalizers_wake() {
+	if( !gc_finalizers.started && !hl_thread_start(gc_finalizer_loop, NULL, false) )
+		hl_fatal("Failed to start GC finalizer thread");
+	gc_finalizers.started = true;
+	gc_cond_signal(&gc_finalizers.wake);
+}
+#endif
+
+// called when a finalizer page is swept : its dead blocks are finalized before they can be reused
+static void gc_page_finalize( gc_pheader *p ) {
+	int bid;
+#	ifdef GC_PARALLEL
+	bool async = (gc_flags & GC_NO_THREADS) == 0;
+	if( async ) gc_mutex_lock(&gc_finalizers.lock);
+#	endif
+	for(bid=p->first_block;bid<p->max_blocks;bid++) {
+		int size = p->sizes[bid];
+		if( !size ) continue;
+		if( !GC_PAGE_MARKED(p) || (p->bmp[bid>>3] & (1<<(bid&7))) == 0 ) {
+			unsigned char *ptr = p->base + bid * p->block_size;
+			void *finalizer = *(void**)ptr;
+#			ifdef GC_PARALLEL
+			if( finalizer && async ) {
+				gc_finalizers_push(ptr);
+				if( !GC_PAGE_MARKED(p) ) gc_page_claim(p);
+				p->bmp[bid>>3] |= 1<<(bid&7);
+				continue;
 			}
-			p = p->next_page;
+#			endif
+			p->sizes[bid] = 0;
+			if( finalizer )
+				((void(*)(void *))finalizer)(ptr);
+#			ifdef GC_DEBUG
+			memset(ptr,0xDD,size*p->block_size);
+#			endif
 		}
 	}
+#	ifdef GC_PARALLEL
+	if( async ) {
+		if( gc_finalizers.pending.count ) gc_finalizers_wake();
+		gc_mutex_unlock(&gc_finalizers.lock);
+	}
+#	endif
+}
+
+// wait until the finalizers of the blocks found dead so far have run
+HL_API void hl_gc_flush_finalizers() {
+	if( current_thread || gc_threads.count == 0 ) {
+		gc_global_lock(true);
+		gc_sweep_pages(0);
+		gc_global_lock(false);
+	}
+#	ifdef GC_PARALLEL
+	if( !gc_finalizers.started ) return;
+	hl_blocking(true);
+	gc_mutex_lock(&gc_finalizers.lock);
+	while( gc_finalizers.pending.count || gc_finalizers.running.count )
+		gc_cond_wait(&gc_finalizers.done,&gc_finalizers.lock);
+	gc_mutex_unlock(&gc_finalizers.lock);
+	hl_blocking(false);
+#	endif
+}
+
+// mark a word that might point to the start of a block
+static inline void **gc_mark_value( gc_mark_thread *m, void **mark_stack, void *p, bool native ) {
+	gc_pheader *page = GC_GET_PAGE(p);
+	int bid;
+	if( !page || !INPAGE(p,page) || (bid = gc_block_start(page,p)) < 0 ) return mark_stack;
+	if( page->sizes ) {
+		if( page->sizes[bid] == 0 ) return mark_stack;
+	} else if( bid < page->first_block )
+		return mark_stack;
+	// native code holding this block can still store into it without a barrier
+	if( native && GC_CARDS_ACTIVE() && MEM_HAS_PTR(page->page_kind) )
+		gc_set_cards(p, page->sizes ? page->sizes[bid] * page->block_size : page->block_size, GC_CARD_NEXT);
+	if( GC_MARK_BIT(page,bid) )
+		GC_PUSH_GEN(p,page);
+	return mark_stack;
+}
+
+static void gc_mark_stack( gc_mark_thread *m, void *start, void *end, bool native ) {
+	void **mark_stack = m->cur;
+	void **stack_head = (void**)start;
+	while( stack_head < (void**)end )
+		mark_stack = gc_mark_value(m,mark_stack,*stack_head++,native);
+	m->cur = mark_stack;
+	m->scanned += (void**)end - (void**)start;
+}
+
+#ifdef HL_GC_STACK_MAPS
+// only the pointer slots of a JIT frame, which JIT code writes with barriers
+static void gc_mark_frame( gc_mark_thread *m, void **frame, unsigned int *bits, int words ) {
+	void **mark_stack = m->cur;
+	int i;
+	for(i=0;i<words;i+=32) {
+		unsigned int b = *bits++;
+		while( b ) {
+			mark_stack = gc_mark_value(m,mark_stack,frame[i + TRAILING_ZEROES(b)],false);
+			b &= b - 1;
+		}
+	}
+	m->cur = mark_stack;
 }
 #endif
 
-static void gc_call_finalizers(){
+// walk the JIT frames from the one that was calling out to native code,
+// everything else (native frames, outgoing arguments, unknown callers) is conservative
+static void gc_mark_thread_stack( gc_mark_thread *m, hl_thread_info *t ) {
+	void **cur = (void**)t->stack_cur;
+	void **top = (void**)t->stack_top;
+#	ifdef HL_GC_STACK_MAPS
+	void **sp = (void**)t->stack_jit[0];
+	void **fp = (void**)t->stack_jit[1];
+	unsigned int *maps = NULL;
+	hl_gc_stack_site *s = sp > cur && sp < top ? gc_find_site(sp[-1],&maps) : NULL;
+	while( s && fp > cur && fp < top ) {
+		unsigned int *map;
+		void **frame;
+		if( s->map < 0 ) {
+			// entry from native code, which saved the frame that was calling out before
+			sp = (void**)fp[-1];
+			gc_mark_stack(m,cur,fp,true);
+			cur = fp;
+			fp = (void**)fp[-2];
+			s = sp > cur && sp < top ? gc_find_site(sp[-1],&maps) : NULL;
+			continue;
+		}
+		map = maps + s->map;
+		frame = fp - map[0];
+		if( frame < cur ) break;
+		gc_mark_stack(m,cur,frame,true);
+		gc_mark_frame(m,frame,map + 1,(int)map[0]);
+		cur = fp + 2; // saved frame pointer and return address
+		s = gc_find_site(fp[1],&maps);
+		fp = (void**)fp[0];
+	}
+#	endif
+	gc_mark_stack(m,cur,top,true);
+}
+
+// rescan the old blocks intersecting a dirty card, they might reference young blocks
+static void gc_mark_page_cards( gc_mark_thread *m, gc_pheader *p ) {
+	unsigned char *c = p->base;
+	unsigned char *end = p->base + p->page_size;
+	void **mark_stack;
+	// no old blocks
+	if( ATOMIC_LOAD(&p->mark_epoch) != gc_mark_epoch ) return;
+	while( c < end && !GC_CARD(c) )
+		c += GC_CARD_SIZE;
+	if( c == end ) return;
+	if( GC_IS_LARGE(p) ) {
+		// only scan the dirty cards of the object
+		if( p->bmp[0] & 1 )
+			for(;c<end;c+=GC_CARD_SIZE)
+				if( GC_CARD(c) ) gc_mark_stack(m,c,c+GC_CARD_SIZE,false);
+		return;
+	}
+	if( p->sizes ) {
+		// var blocks can be large : only scan the part that is in a dirty card
+		int bid;
+		for(bid=p->first_block;bid<p->max_blocks;bid++) {
+			unsigned char *b, *e;
+			if( !p->sizes[bid] || (p->bmp[bid>>3] & (1<<(bid&7))) == 0 ) continue;
+			b = p->base + bid * p->block_size;
+			e = b + p->sizes[bid] * p->block_size;
+			while( b < e ) {
+				unsigned char *next = (unsigned char*)(((int_val)b | (GC_CARD_SIZE - 1)) + 1);
+				if( next > e ) next = e;
+				if( GC_CARD(b) ) gc_mark_stack(m,b,next,false);
+				b = next;
+			}
+			bid += p->sizes[bid] - 1;
+		}
+		return;
+	}
+	mark_stack = m->cur;
+	for(;c<end;c+=GC_CARD_SIZE) {
+		int bid, last;
+		if( !GC_CARD(c) ) continue;
+		bid = GC_BLOCK_INDEX(p,c - p->base);
+		last = GC_BLOCK_INDEX(p,c + GC_CARD_SIZE - 1 - p->base);
+		if( bid < p->first_block ) bid = p->first_block;
+		if( last >= p->max_blocks ) last = p->max_blocks - 1;
+		for(;bid<=last;bid++)
+			if( p->bmp[bid>>3] & (1<<(bid&7)) ) {
+				if( mark_stack == m->end ) mark_stack = gc_mark_grow(m,mark_stack);
+				*mark_stack++ = p->base + bid * p->block_size;
+			}
+	}
+	m->cur = mark_stack;
+}
+
+static void gc_mark_cards( gc_mark_thread *m, int id, int n ) {
+	int pid, k = 0;
+	for(pid=0;pid<GC_ALL_PAGES;pid++) {
+		gc_pheader *p;
+		if( !MEM_HAS_PTR(pid & PAGE_KIND_MASK) ) continue;
+		for(p=gc_pages[pid];p;p=p->next_page)
+			if( (k++ % n) == id )
+				gc_mark_page_cards(m,p);
+	}
+}
+
+// only the cards kept for the next collection stay dirty
+static void gc_clear_cards() {
 	int i;
-	for(i=MEM_KIND_FINALIZER;i<GC_ALL_PAGES;i+=1<<PAGE_KIND_BITS) {
-		gc_pheader *p = gc_pages[i];
-		while( p ) {
-			int bid;
-			for(bid=p->first_block;bid<p->max_blocks;bid++) {
-				int size = p->sizes[bid];
-				if( !size ) continue;
-				if( (p->bmp[bid>>3] & (1<<(bid&7))) == 0 ) {
-					unsigned char *ptr = p->base + bid * p->block_size;
-					void *finalizer = *(void**)ptr;
-					p->sizes[bid] = 0;
-					if( finalizer )
-						((void(*)(void *))finalizer)(ptr);
-#					ifdef GC_DEBUG
-					memset(ptr,0xDD,size*p->block_size);
-#					endif
+	unsigned int *c = (unsigned int*)hl_gc_cards;
+	for(i=0;i<HL_GC_CARDS>>2;i++)
+		c[i] = (c[i] >> 1) & 0x01010101;
+}
+
+static void **gc_mark_root( gc_mark_thread *m, void **mark_stack, void *p ) {
+	gc_pheader *page;
+	int bid;
+	if( !p ) return mark_stack;
+	page = GC_GET_PAGE(p);
+	if( !page || !INPAGE(p,page) ) return mark_stack; // the value was set to a not gc allocated ptr
+	// don't check if valid ptr : it's a manual added root, so should be valid
+	bid = GC_BLOCK_INDEX(page,(unsigned char*)p - page->base);
+
+#	ifdef GC_DEBUG
+	// only check if valid ptr in debug : it's a manual added root, so shouldn't be an invalid ptr
+	bool valid = true;
+	if( gc_block_start(page,p) < 0 ) valid = false;
+	if( page->sizes ) {
+		if( page->sizes[bid] == 0 ) valid = false;
+	} else if( bid < page->first_block )
+		valid = false;
+	if( !valid ) hl_fatal("Root containing invalid ptr");
+#	endif
+
+	if( GC_MARK_BIT(page,bid) )
+		GC_PUSH_GEN(p,page);
+	return mark_stack;
+}
+
+// each mark thread takes every n-th root and thread stack
+static void gc_mark_roots( gc_mark_thread *m, int id, int n ) {
+	void **mark_stack = m->cur;
+	int64 time = gc_clock();
+	hl_arena *a;
+	int i, k;
+	for(i=id;i<gc_roots_count;i+=n)
+		if( !GC_ROOT_FREE(gc_roots[i]) )
+			mark_stack = gc_mark_root(m,mark_stack,*gc_roots[i]);
+	m->cur = mark_stack;
+	// the arenas are not typed, their content is scanned like a stack
+	i = 0;
+	for(a=gc_arenas;a;a=a->next) {
+		hl_alloc_block *b;
+		if( (i++ % n) != id ) continue;
+		for(b=a->alloc.cur;b;b=b->next)
+			gc_mark_stack(m,b + 1,b->p,false);
+	}
+	// the phases are timed by the collecting thread
+	if( id == 0 ) {
+		gc_phase_time(GC_PHASE_ROOTS, time);
+		time = gc_clock();
+	}
+
+	// scan threads stacks & registers
+	for(i=id;i<gc_threads.count;i+=n) {
+		hl_thread_info *t = gc_threads.threads[i];
+		gc_local *l = (gc_local*)t->gc_local;
+		mark_stack = m->cur;
+		for(k=0;k<l->roots_count;k++)
+			mark_stack = gc_mark_root(m,mark_stack,*l->roots[k]);
+		m->cur = mark_stack;
+		gc_mark_thread_stack(m,t);
+		gc_mark_stack(m,&t->gc_regs,(void**)&t->gc_regs + (sizeof(jmp_buf) / sizeof(void*) - 1),true);
+	}
+	if( id == 0 ) {
+		gc_phase_time(GC_PHASE_STACKS, time);
+		time = gc_clock();
+	}
+
+	if( gc_mark_minor ) {
+		gc_mark_cards(m, id, n);
+		if( id == 0 ) gc_phase_time(GC_PHASE_ROOTS, time);
+	}
+}
+
+// mark until our stack is empty and no other mark thread has work left to steal
+static void gc_mark_drain( gc_mark_thread *m ) {
+	while( true ) {
+		gc_flush_mark(m,0);
+#		ifdef GC_PARALLEL
+		if( gc_mark_parallel ) {
+			if( gc_mark_steal(m) )
+				continue;
+			ATOMIC_ADD(&gc_mark_active,-1);
+			while( gc_mark_active ) {
+				int i;
+				for(i=0;i<gc_mark_threads_count;i++)
+					if( gc_mark_threads[i].shared_count )
+						break;
+				if( i < gc_mark_threads_count ) {
+					ATOMIC_ADD(&gc_mark_active,1);
+					if( gc_mark_steal(m) )
+						break;
+					ATOMIC_ADD(&gc_mark_active,-1);
 				}
+				gc_yield();
 			}
-			p = p->next_page;
+			if( gc_mark_active )
+				continue;
 		}
+#		endif
+		break;
 	}
 }
 
-static void gc_mark_stack( void *start, void *end ) {
-	void **mark_stack = cur_mark_stack;
-	void **stack_head = (void**)start;
-	while( stack_head < (void**)end ) {
-		void *p = *stack_head++;
-		gc_pheader *page = GC_GET_PAGE(p);
-		int bid;
-		if( !page || !INPAGE(p,page) || (((unsigned char*)p - page->base)%page->block_size) != 0 ) continue;
-		bid = (int)((unsigned char*)p - page->base) / page->block_size;
-		if( page->sizes ) {
-			if( page->sizes[bid] == 0 ) continue;
-		} else if( bid < page->first_block )
-			continue;
-		if( (page->bmp[bid>>3] & (1<<(bid&7))) == 0 ) {
-			page->bmp[bid>>3] |= 1<<(bid&7);
-			GC_PUSH_GEN(p,page);
+#ifdef GC_PARALLEL
+static void gc_mark_helper( gc_mark_thread *m ) {
+	int id = (int)(m - gc_mark_threads);
+	while( true ) {
+		gc_sem_wait(&m->start);
+		gc_mark_roots(m, id, gc_mark_threads_count);
+		gc_mark_drain(m);
+		gc_sem_post(&gc_mark_done);
+	}
+}
+#endif
+
+// -------------------------  WEAK REFERENCES ---------------------------------------------------
+
+// weak cells and ephemeron tables are NOPTR blocks, so the mark does not trace them. once the strong
+// mark is done, the values of the ephemerons with a live key are marked until nothing changes,
+// then the references to dead blocks are cleared
+typedef struct {
+	void **items;
+	int count;
+	int max;
+} gc_weak_list;
+
+static gc_weak_list gc_weak_cells = {0};
+static gc_weak_list gc_weak_tables = {0};
+
+static void gc_weak_add( gc_weak_list *l, void *ptr ) {
+	gc_global_lock(true);
+	if( l->count == l->max ) {
+		int nmax = l->max ? l->max << 1 : 256;
+		void **items = (void**)realloc(l->items, sizeof(void*) * nmax);
+		if( items == NULL ) out_of_memory("weak");
+		l->items = items;
+		l->max = nmax;
+	}
+	l->items[l->count++] = ptr;
+	gc_global_lock(false);
+}
+
+// false for the blocks the collection did not mark, true for anything else
+static bool gc_is_live( void *p ) {
+	gc_pheader *page = GC_GET_PAGE(p);
+	int bid;
+	if( !page || !INPAGE(p,page) || (bid = gc_block_start(page,p)) < 0 ) return true;
+	if( page->sizes ? page->sizes[bid] == 0 : bid < page->first_block ) return true;
+	return GC_PAGE_MARKED(page) && (page->bmp[bid>>3] & (1<<(bid&7))) != 0;
+}
+
+static int gc_ephemerons_count( hl_ephemeron *e ) {
+	gc_pheader *p = GC_GET_PAGE(e);
+	int bid = GC_BLOCK_INDEX(p,(unsigned char*)e - p->base);
+	return (p->sizes ? p->sizes[bid] * p->block_size : p->block_size) / (int)sizeof(hl_ephemeron);
+}
+
+static void gc_mark_weaks( gc_mark_thread *m ) {
+	int i, j, k, n;
+	bool changed = true;
+	while( changed ) {
+		changed = false;
+		for(i=0;i<gc_weak_tables.count;i++) {
+			hl_ephemeron *e = (hl_ephemeron*)gc_weak_tables.items[i];
+			void **mark_stack = m->cur;
+			if( !gc_is_live(e) ) continue;
+			n = gc_ephemerons_count(e);
+			for(k=0;k<n;k++,e++)
+				if( e->key && e->value && gc_is_live(e->key) )
+					mark_stack = gc_mark_value(m,mark_stack,e->value,false);
+			if( mark_stack != m->cur ) {
+				m->cur = mark_stack;
+				changed = true;
+			}
+		}
+		if( changed ) gc_flush_mark(m,0);
+	}
+	for(i=j=0;i<gc_weak_cells.count;i++) {
+		void **c = (void**)gc_weak_cells.items[i];
+		if( !gc_is_live(c) ) continue;
+		if( *c && !gc_is_live(*c) ) *c = NULL;
+		gc_weak_cells.items[j++] = c;
+	}
+	gc_weak_cells.count = j;
+	for(i=j=0;i<gc_weak_tables.count;i++) {
+		hl_ephemeron *e = (hl_ephemeron*)gc_weak_tables.items[i];
+		if( !gc_is_live(e) ) continue;
+		gc_weak_tables.items[j++] = e;
+		n = gc_ephemerons_count(e);
+		for(k=0;k<n;k++,e++)
+			if( e->key && !gc_is_live(e->key) ) {
+				e->key = NULL;
+				e->value = NULL;
+			}
+	}
+	gc_weak_tables.count = j;
+}
+
+// the blocks queued for their finalizer are only released once it has run. the dead blocks
+// of finalizer pages are resurrected and queued before the sweep can reuse what they reference
+static void gc_mark_finalizers( gc_mark_thread *m ) {
+#	ifdef GC_PARALLEL
+	int pid, count, bid;
+	if( gc_flags & GC_NO_THREADS ) return;
+	gc_mutex_lock(&gc_finalizers.lock);
+	gc_finalizers_keep(m, &gc_finalizers.pending, 0);
+	gc_finalizers_keep(m, &gc_finalizers.running, 0);
+	count = gc_finalizers.pending.count;
+	for(pid=MEM_KIND_FINALIZER;pid<GC_ALL_PAGES;pid+=1<<PAGE_KIND_BITS) {
+		gc_pheader *p;
+		for(p=gc_pages[pid];p;p=p->next_page)
+			for(bid=p->first_block;bid<p->max_blocks;bid++) {
+				if( !p->sizes[bid] ) continue;
+				if( GC_PAGE_MARKED(p) && (p->bmp[bid>>3] & (1<<(bid&7))) ) continue;
+				if( *(void**)(p->base + bid * p->block_size) ) gc_finalizers_push(p->base + bid * p->block_size);
+			}
+	}
+	gc_finalizers_keep(m, &gc_finalizers.pending, count);
+	if( gc_finalizers.pending.count > count ) gc_finalizers_wake();
+	gc_mutex_unlock(&gc_finalizers.lock);
+	gc_flush_mark(m, 0);
+#	endif
+}
+
+// the pages are swept later, by the allocator
+static void gc_mark_end() {
+	int pid;
+	for(pid=0;pid<GC_ALL_PAGES;pid++) {
+		gc_free_pages[pid] = gc_pages[pid];
+		gc_free_index_reset(pid);
+	}
+	gc_sweep_epoch++;
+	gc_sweep.pid = GC_ALL_PAGES - 1;
+	gc_sweep.link = &gc_pages[gc_sweep.pid];
+	if( GC_CARDS_ACTIVE() )
+		gc_clear_cards();
+}
+
+static void gc_mark( bool minor ) {
+	gc_mark_thread *m = gc_mark_threads;
+	int64 time;
+	int i;
+	// threads give back their pages since all cursors are reset
+	for(i=0;i<gc_threads.count;i++)
+		gc_local_flush(gc_threads.threads[i]);
+	if( !minor ) {
+		// a major collection takes over any incremental mark in progress
+		if( gc_mark_phase ) {
+			int pid;
+			gc_pheader *p;
+			for(pid=0;pid<GC_ALL_PAGES;pid++)
+				for(p=gc_pages[pid];p;p=p->next_page)
+					p->alloc_marked = false;
+			gc_mark_phase = false;
+		}
+		gc_mark_epoch++;
+		m->cur = m->stack;
+		gc_census.active = !gc_snapshot_mark && gc_census.every && ++gc_census.majors % gc_census.every == 0;
+	}
+	gc_mark_minor = minor;
+
+#	ifdef GC_PARALLEL
+	if( gc_mark_threads_count > 1 ) {
+		if( !gc_mark_helpers_started ) {
+			for(i=1;i<gc_mark_threads_count;i++)
+				if( !hl_thread_start(gc_mark_helper, gc_mark_threads + i, false) )
+					hl_fatal("Failed to start GC mark thread");
+			gc_mark_helpers_started = true;
 		}
+		gc_mark_parallel = true;
+		gc_mark_active = gc_mark_threads_count;
+		for(i=1;i<gc_mark_threads_count;i++)
+			gc_sem_post(&gc_mark_threads[i].start);
 	}
-	cur_mark_stack = mark_stack;
+#	endif
+	gc_mark_roots(m, 0, gc_mark_parallel ? gc_mark_threads_count : 1);
+	time = gc_clock();
+	gc_mark_drain(m);
+#	ifdef GC_PARALLEL
+	if( gc_mark_parallel ) {
+		for(i=1;i<gc_mark_threads_count;i++)
+			gc_sem_wait(&gc_mark_done);
+		gc_mark_parallel = false;
+	}
+#	endif
+	gc_mark_finalizers(m);
+	gc_mark_weaks(m);
+	gc_phase_time(GC_PHASE_MARK, time);
+	gc_mark_minor = false;
+	if( gc_census.active ) gc_census_merge();
+	gc_mark_end();
+}
+
+// push all the blocks of a page allocated during the incremental mark
+static void gc_mark_page_all( gc_mark_thread *m, gc_pheader *page ) {
+	void **mark_stack = m->cur;
+	int bid;
+	for(bid=page->first_block;bid<page->max_blocks;bid++) {
+		if( (page->bmp[bid>>3] & (1<<(bid&7))) == 0 ) continue;
+		if( page->sizes && !page->sizes[bid] ) continue;
+		GC_PUSH_GEN(page->base + bid * page->block_size, page);
+		if( page->sizes ) bid += page->sizes[bid] - 1;
+	}
+	m->cur = mark_stack;
 }
 
-static void gc_mark() {
-	void **mark_stack = cur_mark_stack;
-	int mark_bytes = gc_stats.mark_bytes;
+static void gc_mark_begin() {
+	gc_mark_thread *m = gc_mark_threads;
+	int i;
+	for(i=0;i<gc_threads.count;i++)
+		gc_local_flush(gc_threads.threads[i]);
+	gc_mark_epoch++;
+	for(i=0;i<GC_ALL_PAGES;i++)
+		gc_free_index_reset(i);
+	memset(hl_gc_cards,0,HL_GC_CARDS);
+	m->cur = m->stack;
+	gc_mark_roots(m, 0, 1);
+	gc_mark_phase = true;
+}
+
+// rescan what the mutators could have changed since the mark started
+static void gc_mark_complete() {
+	gc_mark_thread *m = gc_mark_threads;
 	int pid, i;
-	unsigned char *mark_cur;
-	// prepare mark bits
-	if( mark_bytes > mark_size ) {
-		gc_free_page_memory(mark_data, mark_size);
-		if( mark_size == 0 ) mark_size = GC_PAGE_SIZE;
-		while( mark_size < mark_bytes )
-			mark_size <<= 1;
-		mark_data = gc_alloc_page_memory(mark_size);
-		if( mark_data == NULL ) out_of_memory("markbits");
-	}
-	mark_cur = mark_data;
-	MZERO(mark_data,mark_bytes);
+	for(i=0;i<gc_threads.count;i++)
+		gc_local_flush(gc_threads.threads[i]);
 	for(pid=0;pid<GC_ALL_PAGES;pid++) {
-		gc_pheader *p = gc_pages[pid];
-		gc_free_pages[pid] = p;
-		gc_free_blocks[pid] = 0;
-		while( p ) {
-			p->bmp = mark_cur;
-			p->next_block = p->first_block;
-			p->free_blocks = 0;
-			mark_cur += (p->max_blocks + 7) >> 3;
-			p = p->next_page;
+		gc_pheader *p;
+		for(p=gc_pages[pid];p;p=p->next_page)
+			if( p->alloc_marked ) {
+				gc_mark_page_all(m, p);
+				p->alloc_marked = false;
+			}
+	}
+	int64 time;
+	gc_mark_roots(m, 0, 1);
+	time = gc_clock();
+	gc_mark_cards(m, 0, 1);
+	gc_phase_time(GC_PHASE_ROOTS, time);
+	time = gc_clock();
+	gc_flush_mark(m, 0);
+	gc_mark_finalizers(m);
+	gc_mark_weaks(m);
+	gc_phase_time(GC_PHASE_MARK, time);
+	gc_mark_phase = false;
+	gc_mark_end();
+}
+
+// -------------------------  COMPACTION -------------------------------------------------------
+
+// mostly-copying compaction, after a stop-the-world major mark : the live blocks of sparse NOPTR
+// and DYNAMIC pages are copied into other pages and the emptied pages are released. a block
+// referenced by a word that is not known to be a pointer (stacks, objects fields, raw blocks) is
+// pinned, only the precise references (pointer arrays elements, root values, weak cells targets,
+// ephemeron values) are updated. memory kept by native code without a root must not be in these pages.
+
+#define GC_BLOCK_LIVE(p,bid)	((p)->bmp[(bid)>>3] & (1 << ((bid)&7)))
+#define GC_BLOCK_PINNED(p,bid)	((p)->pins[(bid)>>3] & (1 << ((bid)&7)))
+
+typedef void (*gc_word_callb)( void **w, bool precise );
+
+// the live block of a compacted page holding ptr, or -1
+static int gc_compact_block( gc_pheader *p, void *ptr ) {
+	int bid = GC_BLOCK_INDEX(p,(unsigned char*)ptr - p->base);
+	if( bid < p->first_block || bid >= p->max_blocks ) return -1;
+	if( p->sizes ) {
+		int start = bid;
+		while( start > p->first_block && p->sizes[start] == 0 && bid - start < 255 ) start--;
+		if( start + p->sizes[start] <= bid ) return -1;
+		bid = start;
+	}
+	return GC_BLOCK_LIVE(p,bid) ? bid : -1;
+}
+
+static void gc_compact_pin( void *ptr ) {
+	gc_pheader *p = GC_GET_PAGE(ptr);
+	int bid;
+	if( !p || !p->pins || !INPAGE(ptr,p) ) return;
+	bid = gc_compact_block(p,ptr);
+	if( bid >= 0 ) p->pins[bid>>3] |= 1 << (bid&7);
+}
+
+static void *gc_compact_forward( void *ptr ) {
+	gc_pheader *p = GC_GET_PAGE(ptr);
+	unsigned char *b;
+	int bid;
+	if( !p || !p->pins || !INPAGE(ptr,p) ) return ptr;
+	bid = gc_compact_block(p,ptr);
+	if( bid < 0 || GC_BLOCK_PINNED(p,bid) ) return ptr;
+	// the block was moved, its first word holds the new address
+	b = p->base + bid * p->block_size;
+	return *(unsigned char**)b + ((unsigned char*)ptr - b);
+}
+
+static void gc_compact_pin_word( void **w, bool precise ) {
+	if( !precise ) gc_compact_pin(*w);
+}
+
+static void gc_compact_fix_word( void **w, bool precise ) {
+	if( precise ) *w = gc_compact_forward(*w);
+}
+
+// tells for each word of a block if it is known to hold a pointer : only the elements of the arrays
+// of pointers, the types mark bits are not used by the mark so their layouts are not trusted here
+static void gc_compact_words( gc_pheader *page, void **block, int size, gc_word_callb callb ) {
+	int nwords = size / HL_WSIZE;
+	int pos, first = 0, last = 0;
+	if( page->page_kind == MEM_KIND_DYNAMIC && *(hl_type**)block == &hlt_array ) {
+		varray *a = (varray*)block;
+		if( a->at && hl_is_ptr(a->at) ) {
+			first = sizeof(varray) / HL_WSIZE;
+			last = first + a->size;
+			if( a->size < 0 || last > nwords ) last = first;
 		}
 	}
-	// push roots
-	for(i=0;i<gc_roots_count;i++) {
-		void *p = *gc_roots[i];
-		gc_pheader *page;
-		int bid;
-		if( !p ) continue;
-		page = GC_GET_PAGE(p);
-		if( !page || !INPAGE(p,page) ) continue; // the value was set to a not gc allocated ptr
-		// don't check if valid ptr : it's a manual added root, so should be valid
-		bid = (int)((unsigned char*)p - page->base) / page->block_size;
+	for(pos=0;pos<nwords;pos++)
+		callb(block + pos, pos >= first && pos < last);
+}
 
-#		ifdef GC_DEBUG
-		// only check if valid ptr in debug : it's a manual added root, so shouldn't be an invalid ptr
-		bool valid = true;
-		if( (((unsigned char*)p - page->base)%page->block_size) != 0 ) valid = false;
-		if( page->sizes ) {
-			if( page->sizes[bid] == 0 ) valid = false;
-		} else if( bid < page->first_block )
-			valid = false;
-		if( !valid ) hl_fatal("Root containing invalid ptr");
-#		endif
+// the live blocks of a page, without the old copies once they are moved
+static void gc_compact_scan( gc_pheader *p, gc_word_callb callb, bool moved ) {
+	int bid = p->first_block;
+	if( !MEM_HAS_PTR(p->page_kind) || !GC_PAGE_MARKED(p) ) return;
+	while( bid < p->max_blocks ) {
+		int n;
+		if( !GC_BLOCK_LIVE(p,bid) ) {
+			bid++;
+			continue;
+		}
+		n = p->sizes ? p->sizes[bid] : 1;
+		if( !moved || !p->pins || GC_BLOCK_PINNED(p,bid) )
+			gc_compact_words(p, (void**)(p->base + bid * p->block_size), n * p->block_size, callb);
+		bid += n;
+	}
+}
+
+static void gc_compact_scan_all( gc_word_callb callb, bool moved ) {
+	int pid;
+	for(pid=0;pid<GC_ALL_PAGES;pid++) {
+		gc_pheader *p;
+		for(p=gc_pages[pid];p;p=p->next_page)
+			gc_compact_scan(p, callb, moved);
+	}
+}
 
-		if( (page->bmp[bid>>3] & (1<<(bid&7))) == 0 ) {
-			page->bmp[bid>>3] |= 1<<(bid&7);
-			GC_PUSH_GEN(p,page);
+static int gc_compact_live( gc_pheader *p ) {
+	int bid, live = 0;
+	for(bid=p->first_block;bid<p->max_blocks;bid++)
+		if( GC_BLOCK_LIVE(p,bid) ) {
+			int n = p->sizes ? p->sizes[bid] : 1;
+			live += n;
+			bid += n - 1;
 		}
+	return live;
+}
+
+static void gc_compact_add( gc_pheader *p ) {
+	if( gc_compact.count == gc_compact.max ) {
+		int nmax = gc_compact.max ? gc_compact.max << 1 : 64;
+		gc_pheader **pages = (gc_pheader**)realloc(gc_compact.pages, sizeof(void*) * nmax);
+		if( pages == NULL ) out_of_memory("compact");
+		gc_compact.pages = pages;
+		gc_compact.max = nmax;
 	}
+	p->pins = (unsigned char*)malloc((p->max_blocks + 7) >> 3);
+	if( p->pins == NULL ) out_of_memory("compact");
+	MZERO(p->pins, (p->max_blocks + 7) >> 3);
+	gc_compact.pages[gc_compact.count++] = p;
+}
 
-	// scan threads stacks & registers
+// the moved blocks fill the free space of the other pages of the kind, then new pages
+static void *gc_compact_alloc( gc_pheader *src, int nblocks ) {
+	int pid = src->pid;
+	gc_pheader *p = gc_compact.dest[pid];
+	void *ptr;
+	bool zero;
+	int bid;
+	while( !p || !(p->sizes ? gc_var_find(p,nblocks) : gc_fixed_find(p)) ) {
+		p = gc_compact.next[pid];
+		while( p && (p->pins || p->owner || !GC_PAGE_MARKED(p)) )
+			p = p->next_page;
+		if( p ) {
+			gc_compact.next[pid] = p->next_page;
+			gc_page_swept(p);
+		} else {
+			p = gc_alloc_new_page(pid, src->block_size, GC_PAGE_SIZE, src->page_kind, src->sizes != NULL);
+			if( p == NULL ) return NULL;
+			MZERO(p->bmp,(p->max_blocks + 7) >> 3);
+			p->mark_epoch = gc_mark_epoch;
+		}
+		gc_compact.dest[pid] = p;
+	}
+	if( p->sizes )
+		return gc_var_take(p, nblocks, nblocks * p->block_size, &zero);
+	bid = p->next_block;
+	ptr = gc_fixed_take(p, &zero);
+	p->bmp[bid>>3] |= 1 << (bid&7);
+	return ptr;
+}
+
+static void gc_compact_pages() {
+	int64 time = gc_clock();
+	hl_arena *a;
+	int pid, i, k, bid;
+	gc_compact.count = 0;
+	memcpy(gc_compact.next, gc_pages, sizeof(gc_pages));
+	// pick the sparse pages, only if there is more than one of the kind
+	for(pid=0;pid<GC_ALL_PAGES;pid++) {
+		int kind = pid & PAGE_KIND_MASK, first = gc_compact.count;
+		gc_pheader *p;
+		if( (kind != MEM_KIND_NOPTR && kind != MEM_KIND_DYNAMIC) || (pid >> PAGE_KIND_BITS) == GC_LARGE_PART )
+			continue;
+		for(p=gc_pages[pid];p;p=p->next_page)
+			if( !p->owner && GC_PAGE_MARKED(p) && gc_compact_live(p) * 100 < (p->max_blocks - p->first_block) * gc_compact.percent )
+				gc_compact_add(p);
+		if( gc_compact.count - first == 1 ) {
+			gc_compact.count--;
+			free(gc_compact.pages[first]->pins);
+			gc_compact.pages[first]->pins = NULL;
+		}
+	}
+	if( gc_compact.count == 0 ) {
+		gc_phase_time(GC_PHASE_RELEASE, time);
+		return;
+	}
+	gc_compact.active = true;
+	// pin the blocks that have conservative or address dependent references
 	for(i=0;i<gc_threads.count;i++) {
 		hl_thread_info *t = gc_threads.threads[i];
-		cur_mark_stack = mark_stack;
-		gc_mark_stack(t->stack_cur,t->stack_top);
-		gc_mark_stack(&t->gc_regs,(void**)&t->gc_regs + (sizeof(jmp_buf) / sizeof(void*) - 1));
-		mark_stack = cur_mark_stack;
+		void **w;
+		for(w=(void**)t->stack_cur;w<(void**)t->stack_top;w++)
+			gc_compact_pin(*w);
+		for(w=(void**)&t->gc_regs;w<(void**)(&t->gc_regs + 1);w++)
+			gc_compact_pin(*w);
+	}
+	gc_compact_scan_all(gc_compact_pin_word, false);
+	for(i=0;i<gc_roots_count;i++)
+		if( !GC_ROOT_FREE(gc_roots[i]) )
+			gc_compact_pin(gc_roots[i]);
+	for(i=0;i<gc_threads.count;i++) {
+		gc_local *l = (gc_local*)gc_threads.threads[i]->gc_local;
+		for(k=0;k<l->roots_count;k++)
+			gc_compact_pin(l->roots[k]);
+	}
+	for(a=gc_arenas;a;a=a->next) {
+		hl_alloc_block *b;
+		void **w;
+		for(b=a->alloc.cur;b;b=b->next)
+			for(w=(void**)(b + 1);w<(void**)b->p;w++)
+				gc_compact_pin(*w);
+	}
+	for(i=0;i<gc_weak_cells.count;i++)
+		gc_compact_pin(gc_weak_cells.items[i]);
+	for(i=0;i<gc_weak_tables.count;i++) {
+		hl_ephemeron *e = (hl_ephemeron*)gc_weak_tables.items[i];
+		int n = gc_ephemerons_count(e);
+		gc_compact_pin(e);
+		// the maps hash their keys by address
+		for(k=0;k<n;k++)
+			if( e[k].key ) gc_compact_pin(e[k].key);
+	}
+	// a page with a pinned block can't be released, moving its other blocks would only spread them
+	k = 0;
+	for(i=0;i<gc_compact.count;i++) {
+		gc_pheader *p = gc_compact.pages[i];
+		int n = (p->max_blocks + 7) >> 3;
+		for(bid=0;bid<n;bid++)
+			if( p->pins[bid] ) break;
+		if( bid < n ) {
+			free(p->pins);
+			p->pins = NULL;
+		} else
+			gc_compact.pages[k++] = p;
+	}
+	gc_compact.count = k;
+	if( k == 0 ) {
+		gc_compact.active = false;
+		gc_phase_time(GC_PHASE_RELEASE, time);
+		return;
+	}
+	// copy, leaving the new address in the old block
+	for(i=0;i<gc_compact.count;i++) {
+		gc_pheader *p = gc_compact.pages[i];
+		for(bid=p->first_block;bid<p->max_blocks;bid++) {
+			int n;
+			unsigned char *b, *to;
+			if( !GC_BLOCK_LIVE(p,bid) ) continue;
+			n = p->sizes ? p->sizes[bid] : 1;
+			if( !GC_BLOCK_PINNED(p,bid) ) {
+				b = p->base + bid * p->block_size;
+				to = (unsigned char*)gc_compact_alloc(p, n);
+				if( to ) {
+					memcpy(to, b, n * p->block_size);
+					*(void**)b = to;
+					gc_compact.moved += n * p->block_size;
+				} else
+					p->pins[bid>>3] |= 1 << (bid&7);
+			}
+			bid += n - 1;
+		}
+	}
+	// update the precise references
+	gc_compact_scan_all(gc_compact_fix_word, true);
+	for(i=0;i<gc_roots_count;i++)
+		if( !GC_ROOT_FREE(gc_roots[i]) )
+			*gc_roots[i] = gc_compact_forward(*gc_roots[i]);
+	for(i=0;i<gc_threads.count;i++) {
+		gc_local *l = (gc_local*)gc_threads.threads[i]->gc_local;
+		for(k=0;k<l->roots_count;k++)
+			*l->roots[k] = gc_compact_forward(*l->roots[k]);
 	}
+	for(i=0;i<gc_weak_cells.count;i++) {
+		void **c = (void**)gc_weak_cells.items[i];
+		*c = gc_compact_forward(*c);
+	}
+	for(i=0;i<gc_weak_tables.count;i++) {
+		hl_ephemeron *e = (hl_ephemeron*)gc_weak_tables.items[i];
+		int n = gc_ephemerons_count(e);
+		for(k=0;k<n;k++)
+			e[k].value = (vdynamic*)gc_compact_forward(e[k].value);
+	}
+	// the old copies are free, the empty pages are released by the sweep
+	for(i=0;i<gc_compact.count;i++) {
+		gc_pheader *p = gc_compact.pages[i];
+		bool empty = true;
+		for(bid=p->first_block;bid<p->max_blocks;bid++) {
+			int n;
+			if( !GC_BLOCK_LIVE(p,bid) ) continue;
+			n = p->sizes ? p->sizes[bid] : 1;
+			if( GC_BLOCK_PINNED(p,bid) )
+				empty = false;
+			else
+				p->bmp[bid>>3] &= ~(1 << (bid&7));
+			bid += n - 1;
+		}
+		if( empty ) {
+			p->mark_epoch = gc_mark_epoch - 1;
+			gc_compact.reclaimed += p->page_size;
+		}
+		free(p->pins);
+		p->pins = NULL;
+	}
+	memset(gc_compact.dest, 0, sizeof(gc_compact.dest));
+	gc_compact.active = false;
+	gc_phase_time(GC_PHASE_RELEASE, time);
+}
+
+// -------------------------  SWEEPING ----------------------------------------------------------
 
-	cur_mark_stack = mark_stack;
-	if( mark_stack ) gc_flush_mark();
-	gc_call_finalizers();
+// with the global lock held, the first time a page is used after a collection
+static void gc_page_sweep( gc_pheader *p ) {
+	p->sweep_epoch = gc_sweep_epoch;
+	if( p->page_kind == MEM_KIND_FINALIZER ) {
+		int64 time = gc_clock();
+		gc_page_finalize(p);
+		gc_phase_time(GC_PHASE_FINALIZE, time);
+	}
 #	ifdef GC_DEBUG
-	gc_clear_unmarked_mem();
+	gc_clear_unmarked_mem(p);
 #	endif
-	gc_flush_empty_pages();
+	p->next_block = p->first_block;
+	// nothing marked : the page is allocated again from its start
+	p->free_blocks = GC_PAGE_MARKED(p) ? 0 : p->max_blocks - p->first_block;
 }
 
-static void gc_major() {
-	int time = TIMESTAMP(), dt;
+// sweep at most budget pages that the allocator did not use yet, or all of them if budget is 0.
+// the empty ones are released, starting with the large objects
+static void gc_sweep_pages( int budget ) {
+	int64 time;
+	int count = 0;
+	while( gc_sweep.pid >= 0 ) {
+		gc_pheader *p = *gc_sweep.link;
+		if( p == NULL ) {
+			if( --gc_sweep.pid >= 0 ) {
+				gc_sweep.link = &gc_pages[gc_sweep.pid];
+				continue;
+			}
+			time = gc_clock();
+			gc_mem_trim();
+			gc_phase_time(GC_PHASE_RELEASE, time);
+			gc_pacer.live = gc_stats.pages_total_memory;
+			if( gc_minor_count == 0 ) gc_major_memory = gc_stats.pages_total_memory;
+			break;
+		}
+		if( p->sweep_epoch == gc_sweep_epoch ) {
+			gc_sweep.link = &p->next_page;
+			continue;
+		}
+		if( budget && count++ == budget )
+			break;
+		gc_page_sweep(p);
+		if( GC_PAGE_MARKED(p) )
+			gc_sweep.link = &p->next_page;
+		else {
+			*gc_sweep.link = p->next_page;
+			time = gc_clock();
+			gc_free_page(p);
+			gc_phase_time(GC_PHASE_RELEASE, time);
+		}
+	}
+}
+
+static void gc_mark_stats( bool minor, int64 dt ) {
+	int64 scanned = 0;
+	int i;
+	for(i=0;i<gc_mark_threads_count;i++) {
+		scanned += gc_mark_threads[i].scanned;
+		gc_mark_threads[i].scanned = 0;
+	}
+	gc_stats.mark_scanned += scanned;
+	gc_stats.last_scanned = scanned;
 	gc_stats.last_mark = gc_stats.total_allocated;
 	gc_stats.last_mark_allocs = gc_stats.allocation_count;
-	gc_stop_world(true);
-	gc_mark();
-	gc_stop_world(false);
-	dt = TIMESTAMP() - time;
+	if( minor )
+		gc_minor_count++;
+	else {
+		gc_minor_count = 0;
+		gc_major_memory = gc_stats.pages_total_memory;
+	}
 	gc_stats.mark_count++;
 	gc_stats.mark_time += dt;
 	if( gc_flags & GC_PROFILE ) {
-		printf("GC-PROFILE %d\n\tmark-time %.3g\n\talloc-time %.3g\n\ttotal-mark-time %.3g\n\ttotal-alloc-time %.3g\n\tallocated %d (%dKB)\n",
+		printf("GC-PROFILE %d%s\n\tmark-time %.3g\n\troots-time %.3g\n\tstacks-time %.3g\n\ttrace-time %.3g\n\tmark-rate %.3g\n\talloc-time %.3g\n\ttotal-mark-time %.3g\n\ttotal-alloc-time %.3g\n\ttrigger %s budget %dKB live %dKB\n\tallocated %d (%dKB)\n\tlarge %d (%dKB)\n",
 			gc_stats.mark_count,
-			dt/1000.,
-			(gc_stats.alloc_time - last_profile.alloc_time)/1000.,
-			gc_stats.mark_time/1000.,
-			gc_stats.alloc_time/1000.,
+			minor ? " minor" : (gc_pause_target ? " incremental" : ""),
+			dt/1e9,
+			gc_phases.last[GC_PHASE_ROOTS]/1e9,
+			gc_phases.last[GC_PHASE_STACKS]/1e9,
+			gc_phases.last[GC_PHASE_MARK]/1e9,
+			dt ? (double)scanned * 1000. / dt : 0., // millions of words per second
+			(gc_stats.alloc_time - last_profile.alloc_time)/1e9,
+			gc_stats.mark_time/1e9,
+			gc_stats.alloc_time/1e9,
+			gc_trigger_names[gc_pacer.last],
+			(int)(gc_pacer.budget >> 10),
+			(int)(gc_pacer.live >> 10),
 			(int)(gc_stats.allocation_count - last_profile.allocation_count),
-			(int)((gc_stats.total_allocated - last_profile.total_allocated)>>10)
+			(int)((gc_stats.total_allocated - last_profile.total_allocated)>>10),
+			gc_stats.large_count,
+			(int)(gc_stats.large_memory>>10)
 		);
 		last_profile.allocation_count = gc_stats.allocation_count;
 		last_profile.alloc_time = gc_stats.alloc_time;
@@ -1020,6 +2949,45 @@ static void gc_major() {
 	}
 }
 
+static void gc_collect( bool minor ) {
+	int64 time, dt;
+	// outside of the pause, the other threads only wait if they need the global lock
+	gc_sweep_pages(0);
+	memset(gc_phases.last, 0, sizeof(gc_phases.last));
+	time = gc_clock();
+	gc_stop_world(true);
+	gc_mark(minor);
+	if( !minor && gc_compact.percent ) gc_compact_pages();
+	gc_stop_world(false);
+	dt = gc_clock() - time;
+	gc_record_pause(dt);
+	gc_mark_stats(minor, dt);
+}
+
+// mark for at most gc_pause_target, or until the mark is complete
+static void gc_mark_slice( bool complete ) {
+	gc_mark_thread *m = gc_mark_threads;
+	int64 time = gc_clock(), dt;
+	gc_stop_world(true);
+	while( m->cur > m->stack && (complete || gc_clock() - time < gc_pause_target) )
+		gc_flush_mark(m, GC_SLICE_WORK);
+	if( m->cur == m->stack && (complete || gc_clock() - time < gc_pause_target) ) {
+		gc_mark_complete();
+		complete = true;
+	}
+	gc_stop_world(false);
+	dt = gc_clock() - time;
+	gc_record_pause(dt);
+	gc_cycle_time += dt;
+	gc_last_slice = gc_stats.total_allocated;
+	if( complete ) gc_mark_stats(false, gc_cycle_time);
+}
+
+static void gc_major() {
+	gc_collect(false);
+	gc_sweep_pages(0);
+}
+
 HL_API void hl_gc_major() {
 	gc_global_lock(true);
 	gc_major();
@@ -1030,12 +2998,12 @@ HL_API bool hl_is_gc_ptr( void *ptr ) {
 	gc_pheader *page = GC_GET_PAGE(ptr);
 	int bid;
 	if( !page || !INPAGE(ptr,page) ) return false;
-	if( ((unsigned char*)ptr - page->base) % page->block_size != 0 ) return false;
-	bid = (int)((unsigned char*)ptr - page->base) / page->block_size;
+	bid = gc_block_start(page,ptr);
+	if( bid < 0 ) return false;
 	if( bid < page->first_block || bid >= page->max_blocks ) return false;
 	if( page->sizes && page->sizes[bid] == 0 ) return false;
-	// not live (only available if we haven't allocate since then)
-	if( page->bmp && page->next_block == page->first_block && (page->bmp[bid>>3]&(1<<(bid&7))) == 0 ) return false;
+	// not live (only available if the page was not used since the last collection)
+	if( page->sweep_epoch != gc_sweep_epoch && (!GC_PAGE_MARKED(page) || (page->bmp[bid>>3]&(1<<(bid&7))) == 0) ) return false;
 	return true;
 }
 
@@ -1044,14 +3012,55 @@ static bool gc_is_active = true;
 static void gc_check_mark() {
 	int64 m = gc_stats.total_allocated - gc_stats.last_mark;
 	int64 b = gc_stats.allocation_count - gc_stats.last_mark_allocs;
-	if( (m > gc_stats.pages_total_memory * gc_mark_threshold || b > gc_stats.pages_blocks * gc_mark_threshold || (gc_flags & GC_FORCE_MAJOR)) && gc_is_active )
-		gc_major();
+	int64 limit;
+	int64 blocks = gc_stats.pages_blocks < (GC_PACER_MIN_HEAP >> 4) ? (GC_PACER_MIN_HEAP >> 4) : gc_stats.pages_blocks;
+	gc_trigger reason;
+	if( !gc_is_active ) return;
+	limit = gc_pacer_budget();
+	if( gc_mark_phase ) {
+		// a slice every 1/64 of the budget, complete at once if the program allocates faster than we mark
+		if( (limit >= 0 && m > limit * 2) || (gc_flags & GC_FORCE_MAJOR) )
+			gc_mark_slice(true);
+		else if( gc_stats.total_allocated - gc_last_slice > ((limit < 0 ? GC_PACER_MIN_HEAP : limit) >> 6) )
+			gc_mark_slice(false);
+		return;
+	}
+	if( gc_flags & GC_FORCE_MAJOR )
+		reason = GC_TRIGGER_FORCED;
+	else if( limit >= 0 && m > limit )
+		reason = gc_pacer.limited ? GC_TRIGGER_LIMIT : GC_TRIGGER_GROWTH;
+	else if( gc_pacer_growth() >= 0 && b > gc_pacer_scale(blocks, gc_pacer_growth()) )
+		reason = GC_TRIGGER_COUNT;
+	else
+		return;
+	{
+		bool minor;
+		gc_pacer.last = reason;
+		gc_pacer.counts[reason]++;
+		// the previous cycle must be swept before we mark again
+		gc_sweep_pages(0);
+		// major collection once the old generation has grown too much
+		minor = gc_generational && (gc_flags & GC_FORCE_MAJOR) == 0 && gc_minor_count < GC_MAX_MINORS && gc_stats.pages_total_memory < gc_major_memory * 2;
+		if( !minor && gc_pause_target && (gc_flags & GC_FORCE_MAJOR) == 0 ) {
+			int64 time = gc_clock();
+			memset(gc_phases.last, 0, sizeof(gc_phases.last));
+			gc_stop_world(true);
+			gc_mark_begin();
+			gc_stop_world(false);
+			gc_record_pause(gc_clock() - time);
+			gc_cycle_time = gc_clock() - time;
+			gc_last_slice = gc_stats.total_allocated;
+		} else
+			gc_collect(minor);
+	}
 }
 
 static void hl_gc_init() {
 	int i;
+#	ifndef GC_HEAP_RANGE
 	for(i=0;i<1<<GC_LEVEL0_BITS;i++)
 		hl_gc_page_map[i] = gc_level1_null;
+#	endif
 	if( TRAILING_ONES(0x080003FF) != 10 || TRAILING_ONES(0) != 0 || TRAILING_ONES(0xFFFFFFFF) != 32 )
 		hl_fatal("Invalid builtin tl1");
 	if( TRAILING_ZEROES((unsigned)~0x080003FF) != 10 || TRAILING_ZEROES(0) != 32 || TRAILING_ZEROES(0xFFFFFFFF) != 0 )
@@ -1061,8 +3070,52 @@ static void hl_gc_init() {
 		gc_flags |= GC_PROFILE;
 	if( getenv("HL_DUMP_MEMORY") )
 		gc_flags |= GC_DUMP_MEM;
+	if( getenv("HL_GC_HUGEPAGES") && strcmp(getenv("HL_GC_HUGEPAGES"),"0") != 0 )
+		gc_flags |= GC_HUGE_PAGES;
+	if( getenv("HL_GC_RETAIN") )
+		gc_retain_ratio = (float)atof(getenv("HL_GC_RETAIN"));
+	if( getenv("HL_GC_CENSUS") )
+		gc_census.every = atoi(getenv("HL_GC_CENSUS"));
+	if( getenv("HL_GC_COMPACT") )
+		gc_compact.percent = atoi(getenv("HL_GC_COMPACT"));
+	if( getenv("HL_GC_GROWTH") ) {
+		// a percent or "off", anything else keeps the default
+		char *v = getenv("HL_GC_GROWTH"), *end;
+		long growth = strtol(v, &end, 10);
+		if( strcmp(v,"off") == 0 )
+			gc_pacer.growth = -1;
+		else if( end != v && *end == 0 && growth >= INT_MIN && growth <= INT_MAX )
+			gc_pacer_set((int)growth, (double)gc_pacer.limit);
+	}
+	if( getenv("HL_GC_LIMIT") )
+		gc_pacer_set(gc_pacer.growth, atof(getenv("HL_GC_LIMIT")) * (1 << 20));
+#	ifdef GC_HEAP_RANGE
+	if( getenv("HL_GC_HEAP_RESERVE") )
+		gc_heap_reserve = (int64)atoi(getenv("HL_GC_HEAP_RESERVE")) << 20;
+#	endif
+#	ifdef GC_PARALLEL
+	if( getenv("HL_GC_THREADS") ) {
+		gc_mark_threads_count = atoi(getenv("HL_GC_THREADS"));
+		if( gc_mark_threads_count < 1 ) gc_mark_threads_count = 1;
+		if( gc_mark_threads_count > 64 ) gc_mark_threads_count = 64;
+	}
+#	endif
+#	endif
+	gc_mark_threads = (gc_mark_thread*)malloc(sizeof(gc_mark_thread) * gc_mark_threads_count);
+	memset(gc_mark_threads, 0, sizeof(gc_mark_thread) * gc_mark_threads_count);
+#	ifdef GC_PARALLEL
+	for(i=0;i<gc_mark_threads_count;i++) {
+		gc_mutex_init(&gc_mark_threads[i].lock);
+		gc_sem_init(&gc_mark_threads[i].start);
+	}
+	gc_sem_init(&gc_mark_done);
+	gc_mutex_init(&gc_safepoint.lock);
+	gc_cond_init(&gc_safepoint.stopped);
+	gc_cond_init(&gc_safepoint.resumed);
+	gc_mutex_init(&gc_finalizers.lock);
+	gc_cond_init(&gc_finalizers.wake);
+	gc_cond_init(&gc_finalizers.done);
 #	endif
-	gc_stats.mark_bytes = 4; // prevent reading out of bmp
 	memset(&gc_threads,0,sizeof(gc_threads));
 	gc_threads.global_lock = hl_mutex_alloc(false);
 #	ifdef HL_THREADS
@@ -1091,17 +3144,22 @@ HL_API void hl_blocking( bool b ) {
 #		ifdef HL_THREADS
 		if( t->gc_blocking == 0 )
 			gc_save_context(t);
-#		endif
+		if( t->gc_blocking++ == 0 ) gc_safepoint_enter();
+#		else
 		t->gc_blocking++;
+#		endif
 	} else if( t->gc_blocking == 0 )
 		hl_error("Unblocked thread");
-	else {
+	else if( t->gc_blocking == 1 )
+		gc_safepoint_leave(t);
+	else
 		t->gc_blocking--;
-		if( t->gc_blocking == 0 && gc_threads.stopping_world ) {
-			gc_global_lock(true);
-			gc_global_lock(false);
-		}
-	}
+}
+
+// let a collection waiting for this thread proceed
+HL_API void hl_gc_safepoint() {
+	hl_blocking(true);
+	hl_blocking(false);
 }
 
 void hl_cache_free();
@@ -1113,15 +3171,10 @@ void hl_global_init() {
 }
 
 void hl_global_free() {
+	hl_gc_flush_finalizers();
 	hl_cache_free();
 }
 
-struct hl_alloc_block {
-	int size;
-	hl_alloc_block *next;
-	unsigned char *p;
-};
-
 void hl_alloc_init( hl_alloc *a ) {
 	a->cur = NULL;
 }
@@ -1208,12 +3261,111 @@ HL_PRIM void hl_free_executable_memory( void *c, int size ) {
 #if defined(HL_CONSOLE)
 void *sys_alloc_align( int size, int align );
 void sys_free_align( void *ptr, int size );
-#elif !defined(HL_WIN)
+#elif !defined(HL_WIN) && !defined(GC_HEAP_RANGE)
 static void *base_addr = (void*)0x40000000;
 #endif
 
-static void *gc_alloc_page_memory( int size ) {
-#if defined(HL_WIN)
+#ifdef GC_HEAP_RANGE
+struct _gc_heap_free {
+	unsigned char *ptr;
+	size_t size;
+	gc_heap_free *next;
+};
+
+static bool gc_heap_init() {
+	size_t size = (size_t)gc_heap_reserve;
+	unsigned char *ptr, *base;
+	gc_pheader **pages;
+	// retry smaller if the address space is limited
+	while( true ) {
+#		ifdef HL_WIN
+		ptr = (unsigned char*)VirtualAlloc(NULL,size,MEM_RESERVE,PAGE_READWRITE);
+#		else
+		ptr = (unsigned char*)mmap(NULL,size,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+		if( ptr == (unsigned char*)-1 ) ptr = NULL;
+#		endif
+		if( ptr || size <= (64 << 20) ) break;
+		size >>= 1;
+	}
+	if( ptr == NULL )
+		return false;
+	base = (unsigned char*)(((int_val)ptr + GC_PAGE_SIZE - 1) & ~(int_val)(GC_PAGE_SIZE - 1));
+	size = (size - (base - ptr)) & ~(size_t)(GC_PAGE_SIZE - 1);
+	// the system only commits the parts of the table that get written
+	pages = (gc_pheader**)calloc(size >> GC_PAGE_BITS, sizeof(gc_pheader*));
+	if( pages == NULL )
+		return false;
+	gc_heap.pages = pages;
+	gc_heap.base = base;
+	gc_heap.top = base;
+	gc_heap.size = size;
+	return true;
+}
+
+// give back an address range, merging it with its free neighbours
+static void gc_heap_release( unsigned char *ptr, size_t size ) {
+	gc_heap_free *prev = NULL, *f = gc_heap.free;
+	while( f && f->ptr < ptr ) {
+		prev = f;
+		f = f->next;
+	}
+	if( prev && prev->ptr + prev->size == ptr ) {
+		prev->size += size;
+		if( f && ptr + size == f->ptr ) {
+			prev->size += f->size;
+			prev->next = f->next;
+			free(f);
+		}
+		return;
+	}
+	if( f && ptr + size == f->ptr ) {
+		f->ptr = ptr;
+		f->size += size;
+		return;
+	}
+	f = (gc_heap_free*)malloc(sizeof(gc_heap_free));
+	if( f == NULL ) return; // leak the range
+	f->ptr = ptr;
+	f->size = size;
+	f->next = prev ? prev->next : gc_heap.free;
+	if( prev ) prev->next = f; else gc_heap.free = f;
+}
+#endif
+
+static void *gc_sys_alloc( int size, bool commit ) {
+#if defined(GC_HEAP_RANGE)
+	gc_heap_free *f, **prev;
+	unsigned char *ptr = NULL;
+	if( gc_heap.base == NULL && !gc_heap_init() )
+		return NULL;
+	// first fit in the released ranges, then extend the used part
+	for(prev=&gc_heap.free;(f = *prev) != NULL;prev=&f->next)
+		if( f->size >= (size_t)size ) {
+			ptr = f->ptr;
+			f->ptr += size;
+			f->size -= size;
+			if( f->size == 0 ) {
+				*prev = f->next;
+				free(f);
+			}
+			break;
+		}
+	if( ptr == NULL ) {
+		if( (size_t)(gc_heap.base + gc_heap.size - gc_heap.top) < (size_t)size )
+			return NULL;
+		ptr = gc_heap.top;
+		gc_heap.top += size;
+	}
+#	ifdef HL_WIN
+	if( commit && VirtualAlloc(ptr,size,MEM_COMMIT,PAGE_READWRITE) == NULL ) {
+#	else
+	if( mprotect(ptr,size,PROT_READ|PROT_WRITE) != 0 ) {
+#	endif
+		gc_heap_release(ptr,size);
+		return NULL;
+	}
+	return ptr;
+#elif defined(HL_WIN)
 #	if defined(GC_DEBUG) && defined(HL_64)
 #		define STATIC_ADDRESS
 #	endif
@@ -1223,11 +3375,11 @@ static void *gc_alloc_page_memory( int size ) {
 #	else
 	static void *start_address = NULL;
 #	endif
-	void *ptr = VirtualAlloc(start_address,size,MEM_RESERVE|MEM_COMMIT,PAGE_READWRITE);
+	void *ptr = VirtualAlloc(start_address,size,MEM_RESERVE|(commit ? MEM_COMMIT : 0),PAGE_READWRITE);
 #	ifdef STATIC_ADDRESS
 	if( ptr == NULL && start_address ) {
 		start_address = NULL;
-		return gc_alloc_page_memory(size);
+		return gc_sys_alloc(size,commit);
 	}
 	start_address += size + ((-size) & (GC_PAGE_SIZE - 1));
 #	endif
@@ -1258,7 +3410,7 @@ static void *gc_alloc_page_memory( int size ) {
 			tmp = NULL;
 		}
 		if( tmp ) tmp = mmap(tmp,tmp_size,PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
-		ptr = gc_alloc_page_memory(size);
+		ptr = gc_sys_alloc(size,commit);
 		if( tmp ) munmap(tmp,tmp_size);
 		return ptr;
 	}
@@ -1267,8 +3419,15 @@ static void *gc_alloc_page_memory( int size ) {
 #endif
 }
 
-static void gc_free_page_memory( void *ptr, int size ) {
-#ifdef HL_WIN
+static void gc_sys_free( void *ptr, int size ) {
+#if defined(GC_HEAP_RANGE)
+#	ifdef HL_WIN
+	VirtualFree(ptr,size,MEM_DECOMMIT);
+#	else
+	mmap(ptr,size,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_FIXED,-1,0);
+#	endif
+	gc_heap_release((unsigned char*)ptr,size);
+#elif defined(HL_WIN)
 	VirtualFree(ptr, 0, MEM_RELEASE);
 #elif defined(HL_CONSOLE)
 	sys_free_align(ptr,size);
@@ -1277,6 +3436,196 @@ static void gc_free_page_memory( void *ptr, int size ) {
 #endif
 }
 
+static bool gc_sys_commit( void *ptr, int size ) {
+#ifdef HL_WIN
+	return VirtualAlloc(ptr,size,MEM_COMMIT,PAGE_READWRITE) != NULL;
+#else
+	return true; // the pages will be zero-filled on first access
+#endif
+}
+
+static void gc_sys_decommit( void *ptr, int size ) {
+#if defined(HL_WIN)
+	VirtualFree(ptr,size,MEM_DECOMMIT);
+#elif !defined(HL_CONSOLE)
+	madvise(ptr,size,MADV_DONTNEED);
+#endif
+}
+
+// pages are carved from large reserved chunks and kept in per-size free lists once empty.
+// free pages stay committed up to gc_retain_ratio of the heap, the others are given back
+// to the system but keep their address range
+#define GC_CHUNK_SIZE	(64 << 20)
+#define GC_MEM_CLASSES	11
+#define GC_HUGE_PAGE	(2 << 20)
+#define GC_HUGE_CLASS	5 // GC_PAGE_SIZE << GC_HUGE_CLASS == GC_HUGE_PAGE
+
+typedef struct _gc_free_mem gc_free_mem;
+struct _gc_free_mem {
+	unsigned char *ptr;
+	bool committed;
+	gc_free_mem *next;
+};
+
+static struct {
+	unsigned char *cur;
+	unsigned char *end;
+	gc_free_mem *free[GC_MEM_CLASSES]; // GC_PAGE_SIZE << class
+	gc_free_mem *nodes;
+	int64 reserved;
+	int64 retained;
+	int64 released;
+} gc_mem = {0};
+
+static int gc_mem_class( int size ) {
+#	ifdef HL_CONSOLE
+	return -1;
+#	else
+	int c = 0;
+	while( c < GC_MEM_CLASSES && (GC_PAGE_SIZE << c) < size )
+		c++;
+	return c < GC_MEM_CLASSES && (GC_PAGE_SIZE << c) == size ? c : -1;
+#	endif
+}
+
+static void gc_mem_add_free( unsigned char *ptr, int c, bool committed ) {
+	gc_free_mem *f = gc_mem.nodes;
+	if( f )
+		gc_mem.nodes = f->next;
+	else {
+		f = (gc_free_mem*)malloc(sizeof(gc_free_mem));
+		if( f == NULL ) out_of_memory("pages");
+	}
+	f->ptr = ptr;
+	f->committed = committed;
+	f->next = gc_mem.free[c];
+	gc_mem.free[c] = f;
+	if( committed )
+		gc_mem.retained += GC_PAGE_SIZE << c;
+	else
+		gc_mem.released += GC_PAGE_SIZE << c;
+}
+
+// ask for transparent huge pages on the 2MB aligned part of this range
+static void gc_mem_huge( unsigned char *ptr, int_val size ) {
+#	ifdef MADV_HUGEPAGE
+	unsigned char *start = (unsigned char*)(((int_val)ptr + GC_HUGE_PAGE - 1) & ~(int_val)(GC_HUGE_PAGE - 1));
+	unsigned char *end = (unsigned char*)((int_val)(ptr + size) & ~(int_val)(GC_HUGE_PAGE - 1));
+	if( end > start ) madvise(start, end - start, MADV_HUGEPAGE);
+#	endif
+}
+
+// put what remains of the current chunk into the free lists
+static void gc_mem_flush_chunk() {
+	int c = GC_MEM_CLASSES - 1;
+	while( gc_mem.cur < gc_mem.end ) {
+		while( gc_mem.cur + (GC_PAGE_SIZE << c) > gc_mem.end )
+			c--;
+		gc_mem_add_free(gc_mem.cur, c, false);
+		gc_mem.cur += GC_PAGE_SIZE << c;
+	}
+}
+
+// zero is cleared if the memory was reused without being decommitted
+static void *gc_alloc_page_memory( int size, bool *zero ) {
+	int c = gc_mem_class(size);
+	gc_free_mem *f, **prev, **best = NULL;
+	unsigned char *ptr;
+	if( c < 0 ) {
+		ptr = (unsigned char*)gc_sys_alloc(size,true);
+		if( ptr ) gc_mem.reserved += size;
+		if( ptr && (gc_flags & GC_HUGE_PAGES) ) gc_mem_huge(ptr,size);
+		return ptr;
+	}
+	// reuse a free page, preferably one that is still committed
+	for(prev=&gc_mem.free[c];(f = *prev) != NULL;prev=&f->next) {
+		if( best == NULL || f->committed ) best = prev;
+		if( f->committed ) break;
+	}
+	if( best ) {
+		f = *best;
+		if( !f->committed && !gc_sys_commit(f->ptr,size) )
+			return NULL;
+		*best = f->next;
+		if( f->committed ) {
+			gc_mem.retained -= size;
+			*zero = false;
+		} else
+			gc_mem.released -= size;
+		ptr = f->ptr;
+		f->next = gc_mem.nodes;
+		gc_mem.nodes = f;
+		return ptr;
+	}
+	if( gc_mem.cur + size > gc_mem.end ) {
+		unsigned char *chunk = (unsigned char*)gc_sys_alloc(GC_CHUNK_SIZE,false);
+		if( chunk == NULL ) {
+			ptr = (unsigned char*)gc_sys_alloc(size,true);
+			if( ptr ) gc_mem.reserved += size;
+			return ptr;
+		}
+		gc_mem_flush_chunk();
+		gc_mem.cur = chunk;
+		gc_mem.end = chunk + GC_CHUNK_SIZE;
+		gc_mem.reserved += GC_CHUNK_SIZE;
+		if( gc_flags & GC_HUGE_PAGES ) {
+			// carve from the first 2MB boundary, the pages before it stay available
+			unsigned char *start = (unsigned char*)(((int_val)chunk + GC_HUGE_PAGE - 1) & ~(int_val)(GC_HUGE_PAGE - 1));
+			gc_mem.end = start;
+			gc_mem_flush_chunk();
+			gc_mem.end = chunk + GC_CHUNK_SIZE;
+			gc_mem_huge(chunk, GC_CHUNK_SIZE);
+		}
+	}
+	ptr = gc_mem.cur;
+	if( !gc_sys_commit(ptr,size) )
+		return NULL;
+	gc_mem.cur += size;
+	return ptr;
+}
+
+static void gc_free_page_memory( void *ptr, int size ) {
+	int c = gc_mem_class(size);
+	if( c < 0 ) {
+		gc_sys_free(ptr,size);
+		gc_mem.reserved -= size;
+		return;
+	}
+	gc_mem_add_free((unsigned char*)ptr, c, true);
+}
+
+// called after a collection has freed its empty pages
+static void gc_mem_trim() {
+	int64 limit = (int64)(gc_stats.pages_total_memory * gc_retain_ratio);
+	// releasing less than a huge page would split it
+	int c, min = (gc_flags & GC_HUGE_PAGES) ? GC_HUGE_CLASS : 0;
+	for(c=GC_MEM_CLASSES-1;c>=min && gc_mem.retained > limit;c--) {
+		gc_free_mem *f;
+		for(f=gc_mem.free[c];f && gc_mem.retained > limit;f=f->next)
+			if( f->committed ) {
+				gc_sys_decommit(f->ptr, GC_PAGE_SIZE << c);
+				f->committed = false;
+				gc_mem.retained -= GC_PAGE_SIZE << c;
+				gc_mem.released += GC_PAGE_SIZE << c;
+			}
+	}
+}
+
+// reserved : address space taken by the GC, retained : free pages kept committed, released : free pages given back to the system
+HL_API void hl_gc_page_stats( double *reserved, double *retained, double *released ) {
+	*reserved = (double)gc_mem.reserved;
+	*retained = (double)gc_mem.retained;
+	*released = (double)gc_mem.released;
+}
+
+// ratio of the heap size that free pages can keep committed
+HL_API void hl_gc_set_retention( double ratio ) {
+	gc_global_lock(true);
+	gc_retain_ratio = ratio < 0 ? 0.f : (float)ratio;
+	gc_mem_trim();
+	gc_global_lock(false);
+}
+
 vdynamic *hl_alloc_dynamic( hl_type *t ) {
 	vdynamic *d = (vdynamic*)hl_gc_alloc_gen(t, sizeof(vdynamic), (hl_is_ptr(t) ? MEM_KIND_DYNAMIC : MEM_KIND_NOPTR) | MEM_ZERO);
 	d->t = t;
@@ -1306,9 +3655,9 @@ vdynamic *hl_alloc_obj( hl_type *t ) {
 	size = rt->size;
 	if( size & (HL_WSIZE-1) ) size += HL_WSIZE - (size & (HL_WSIZE-1));
 	if( t->kind == HSTRUCT ) {
-		o = (vobj*)hl_gc_alloc_gen(t, size, (rt->hasPtr ? MEM_KIND_RAW : MEM_KIND_NOPTR) | MEM_ZERO);
+		o = (vobj*)hl_gc_alloc_gen(t, size, (rt->hasPtr ? MEM_KIND_RAW : MEM_KIND_NOPTR) | MEM_ZERO | MEM_ARENA);
 	} else {
-		o = (vobj*)hl_gc_alloc_gen(t, size, (rt->hasPtr ? MEM_KIND_DYNAMIC : MEM_KIND_NOPTR) | MEM_ZERO);
+		o = (vobj*)hl_gc_alloc_gen(t, size, (rt->hasPtr ? MEM_KIND_DYNAMIC : MEM_KIND_NOPTR) | MEM_ZERO | MEM_ARENA);
 		o->t = t;
 	}
 	for(i=0;i<rt->nbindings;i++) {
@@ -1348,6 +3697,259 @@ HL_API void hl_gc_enable( bool b ) {
 	gc_is_active = b;
 }
 
+// tells that all code storing pointers into the GC heap uses hl_gc_write_barrier.
+// the mode is chosen at startup : it fails once some code has been compiled or started
+HL_API bool hl_gc_set_barriers( bool b ) {
+	gc_global_lock(true);
+	if( (gc_barriers_fixed && b != gc_barriers) || (!b && GC_CARDS_ACTIVE()) ) {
+		gc_global_lock(false);
+		return false;
+	}
+	gc_barriers = b;
+	gc_global_lock(false);
+	return true;
+}
+
+HL_API bool hl_gc_has_barriers() {
+	return gc_barriers;
+}
+
+// called by the JIT before emitting code and by HL/C before running it :
+// returns if barriers are used and prevents the mode from changing afterwards
+HL_API bool hl_gc_fix_barriers() {
+	gc_global_lock(true);
+	gc_barriers_fixed = true;
+	gc_global_lock(false);
+	return gc_barriers;
+}
+
+// generational and incremental modes require the barriers, returns false if they are not used
+HL_API bool hl_gc_set_generational( bool b ) {
+	if( b && !gc_barriers ) return false;
+	gc_global_lock(true);
+	if( b && !gc_generational ) gc_major_memory = 0; // start with a major collection
+	gc_generational = b;
+	gc_global_lock(false);
+	return true;
+}
+
+HL_API bool hl_gc_is_generational() {
+	return gc_generational;
+}
+
+HL_API bool hl_gc_set_pause_target( double ms ) {
+	if( ms > 0 && !gc_barriers ) return false;
+	gc_global_lock(true);
+	if( gc_mark_phase ) gc_mark_slice(true);
+	gc_pause_target = ms > 0 ? (int64)(ms * 1000000) + 1 : 0;
+	gc_global_lock(false);
+	return true;
+}
+
+// growth in percent of the live heap between two collections (at least 1, < 0 to only collect near the limit,
+// the default growth is used if there is none), soft limit in bytes (0 for none)
+HL_API void hl_gc_set_pacing( int growth, double limit ) {
+	gc_global_lock(true);
+	gc_pacer_set(growth, limit);
+	gc_global_lock(false);
+}
+
+// move the blocks of NOPTR and DYNAMIC pages less than percent occupied on each stop-the-world
+// major collection (0 to disable). native code must keep a root on the memory it holds
+HL_API void hl_gc_set_compaction( int percent ) {
+	gc_global_lock(true);
+	gc_compact.percent = percent < 0 ? 0 : percent;
+	gc_global_lock(false);
+}
+
+// count the live objects by type every Nth major collection (0 to disable)
+HL_API void hl_gc_set_census( int every ) {
+	gc_global_lock(true);
+	gc_census.every = every < 0 ? 0 : every;
+	gc_census.majors = 0;
+	gc_global_lock(false);
+}
+
+// the arena memory is freed at once without a collection, it can't be weakly referenced
+static bool gc_in_arena( void *p ) {
+	hl_arena *a;
+	bool found = false;
+	gc_global_lock(true);
+	for(a=gc_arenas;a && !found;a=a->next) {
+		hl_alloc_block *b;
+		for(b=a->alloc.cur;b;b=b->next)
+			if( (unsigned char*)p >= (unsigned char*)(b + 1) && (unsigned char*)p < b->p + b->size ) {
+				found = true;
+				break;
+			}
+	}
+	gc_global_lock(false);
+	return found;
+}
+
+HL_API void hl_gc_check_weak_target( void *target ) {
+	if( target && gc_arenas && gc_in_arena(target) ) hl_error("Can't weakly reference an arena object");
+}
+
+// a weak reference is a block holding a pointer, which is cleared once its target is collected
+HL_API void **hl_gc_alloc_weak( void *target ) {
+	void **w;
+	hl_gc_check_weak_target(target);
+	w = (void**)hl_gc_alloc_noptr(sizeof(void*));
+	*w = target;
+	gc_weak_add(&gc_weak_cells, w);
+	return w;
+}
+
+HL_API void *hl_gc_weak_get( void **w ) {
+	return *w;
+}
+
+// the value of an ephemeron is only kept while its key is, both are cleared when the key is collected
+HL_API hl_ephemeron *hl_gc_alloc_ephemerons( int count ) {
+	hl_ephemeron *e;
+	if( count < 0 || count > INT_MAX / (int)sizeof(hl_ephemeron) ) hl_error("Invalid array size");
+	e = (hl_ephemeron*)hl_gc_alloc_gen(&hlt_bytes, count * (int)sizeof(hl_ephemeron), MEM_KIND_NOPTR | MEM_ZERO);
+	gc_weak_add(&gc_weak_tables, e);
+	return e;
+}
+
+HL_API hl_arena *hl_gc_arena_alloc() {
+	hl_arena *a = (hl_arena*)malloc(sizeof(hl_arena));
+	if( a == NULL ) out_of_memory("arena");
+	hl_alloc_init(&a->alloc);
+	a->size = 0;
+	a->owner = NULL;
+	gc_global_lock(true);
+	a->next = gc_arenas;
+	gc_arenas = a;
+	gc_global_lock(false);
+	return a;
+}
+
+// sets the arena of the current thread (or NULL), returns the previous one
+HL_API hl_arena *hl_gc_arena_set( hl_arena *a ) {
+	hl_thread_info *t = hl_get_thread();
+	gc_local *l;
+	hl_arena *prev;
+	if( !t ) hl_fatal("Can't set arena in unregistered thread");
+	l = (gc_local*)t->gc_local;
+	gc_global_lock(true);
+	if( a && a->owner && a->owner != t ) {
+		gc_global_lock(false);
+		hl_error("Arena is already set on another thread");
+	}
+	prev = l->arena;
+	if( prev ) prev->owner = NULL;
+	if( a ) a->owner = t;
+	l->arena = a;
+	gc_global_lock(false);
+	return prev;
+}
+
+// the objects of the arena must no longer be referenced
+HL_API void hl_gc_arena_free( hl_arena *a ) {
+	hl_arena **prev;
+	gc_global_lock(true);
+	if( a->owner && a->owner != hl_get_thread() ) {
+		gc_global_lock(false);
+		hl_error("Arena is still set on another thread");
+	}
+	if( a->owner ) ((gc_local*)a->owner->gc_local)->arena = NULL;
+	for(prev=&gc_arenas;*prev;prev=&(*prev)->next)
+		if( *prev == a ) {
+			*prev = a->next;
+			break;
+		}
+	gc_global_lock(false);
+	hl_free(&a->alloc);
+	free(a);
+}
+
+HL_API double hl_gc_arena_size( hl_arena *a ) {
+	return (double)a->size;
+}
+
+// returns the number of types counted by the last census, they are sorted by decreasing bytes
+HL_API int hl_gc_census_count( int *collection ) {
+	int count;
+	gc_global_lock(true);
+	if( collection ) *collection = gc_census.collection;
+	count = gc_census.count;
+	gc_global_lock(false);
+	return count;
+}
+
+HL_API bool hl_gc_census_entry( int index, hl_type **t, double *count, double *bytes ) {
+	bool ok;
+	gc_global_lock(true);
+	ok = index >= 0 && index < gc_census.count;
+	if( ok ) {
+		gc_census_entry *e = gc_census.result + index;
+		*t = e->t;
+		*count = (double)e->count;
+		*bytes = (double)e->bytes;
+	}
+	gc_global_lock(false);
+	return ok;
+}
+
+// returns the number of GC pauses and fills the histogram of their durations (an array of i32 or null)
+HL_API int hl_gc_pause_stats( double *total_ms, double *max_ms, varray *buckets ) {
+	int i;
+	*total_ms = gc_pauses.total / 1e6;
+	*max_ms = gc_pauses.max / 1e6;
+	if( buckets ) {
+		if( buckets->at->kind != HI32 ) hl_error("Invalid array type");
+		for(i=0;i<buckets->size;i++)
+			hl_aptr(buckets,int)[i] = i < GC_PAUSE_BUCKETS ? gc_pauses.buckets[i] : 0;
+	}
+	return gc_pauses.count;
+}
+
+static int gc_cmp_time( const void *a, const void *b ) {
+	int64 x = *(int64*)a, y = *(int64*)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// fills at most count values indexed by hl_gc_stat, returns HL_GC_STAT_COUNT
+HL_API int hl_gc_stats_ext( double *values, int count ) {
+	double v[HL_GC_STAT_COUNT];
+	int64 sorted[GC_PAUSE_RECENT];
+	gc_local *l = gc_get_local();
+	int i, n;
+	gc_global_lock(true);
+	n = gc_pauses.count < GC_PAUSE_RECENT ? gc_pauses.count : GC_PAUSE_RECENT;
+	memcpy(sorted, gc_pauses.recent, n * sizeof(int64));
+	qsort(sorted, n, sizeof(int64), gc_cmp_time);
+	v[HL_GC_STAT_ALLOCATED] = (double)gc_stats.total_allocated;
+	v[HL_GC_STAT_ALLOCATIONS] = (double)gc_stats.allocation_count;
+	v[HL_GC_STAT_MEMORY] = (double)gc_stats.pages_total_memory;
+	v[HL_GC_STAT_THREAD_ALLOCATED] = (double)(l->thread_allocated + l->total_allocated);
+	v[HL_GC_STAT_COLLECTIONS] = gc_stats.mark_count;
+	v[HL_GC_STAT_PAUSES] = gc_pauses.count;
+	v[HL_GC_STAT_PAUSE_TOTAL] = gc_pauses.total / 1e6;
+	v[HL_GC_STAT_PAUSE_P50] = n ? sorted[(n - 1) / 2] / 1e6 : 0.;
+	v[HL_GC_STAT_PAUSE_P99] = n ? sorted[(n - 1) * 99 / 100] / 1e6 : 0.;
+	v[HL_GC_STAT_PAUSE_MAX] = gc_pauses.max / 1e6;
+	for(i=0;i<GC_PHASES;i++) {
+		v[HL_GC_STAT_ROOTS + i] = gc_phases.last[i] / 1e6;
+		v[HL_GC_STAT_TOTAL_ROOTS + i] = gc_phases.total[i] / 1e6;
+	}
+	v[HL_GC_STAT_SCANNED] = (double)gc_stats.last_scanned;
+	v[HL_GC_STAT_BUDGET] = (double)gc_pacer.budget;
+	v[HL_GC_STAT_LIVE] = (double)gc_pacer.live;
+	v[HL_GC_STAT_TRIGGER] = gc_pacer.last;
+	v[HL_GC_STAT_LIMITED] = gc_pacer.counts[GC_TRIGGER_LIMIT];
+	v[HL_GC_STAT_COMPACT_MOVED] = (double)gc_compact.moved;
+	v[HL_GC_STAT_COMPACT_RECLAIMED] = (double)gc_compact.reclaimed;
+	gc_global_lock(false);
+	if( count > HL_GC_STAT_COUNT ) count = HL_GC_STAT_COUNT;
+	for(i=0;i<count;i++)
+		values[i] = v[i];
+	return HL_GC_STAT_COUNT;
+}
+
 HL_API int hl_gc_get_flags() {
 	return gc_flags;
 }
@@ -1373,6 +3975,13 @@ static void fdump_p( void *p ) {
 static void fdump_d( void *p, int size ) {
 	fwrite(p,1,size,fdump);
 }
+static void fdump_z( int size ) {
+	static char ZEROMEM[256] = {0};
+	while( size > 0 ) {
+		fwrite(ZEROMEM,1,size < 256 ? size : 256,fdump);
+		size -= 256;
+	}
+}
 
 static hl_types_dump gc_types_dump = NULL;
 HL_API void hl_gc_set_dump_types( hl_types_dump tdump ) {
@@ -1383,7 +3992,7 @@ HL_API void hl_gc_dump_memory( const char *filename ) {
 	int i;
 	gc_global_lock(true);
 	gc_stop_world(true);
-	gc_mark();
+	gc_mark(false);
 	fdump = fopen(filename,"wb");
 	// header
 	fdump_d("HMD0",4);
@@ -1401,8 +4010,8 @@ HL_API void hl_gc_dump_memory( const char *filename ) {
 			fdump_i(p->max_blocks);
 			fdump_i(p->next_block);
 			fdump_d(p->base,p->page_size);
-			fdump_i((p->bmp ? 1 :0) | (p->sizes?2:0));
-			if( p->bmp ) fdump_d(p->bmp,(p->max_blocks + 7) >> 3);
+			fdump_i(1 | (p->sizes?2:0));
+			if( GC_PAGE_MARKED(p) ) fdump_d(p->bmp,(p->max_blocks + 7) >> 3); else fdump_z((p->max_blocks + 7) >> 3);
 			if( p->sizes ) fdump_d(p->sizes,p->max_blocks);
 			p = p->next_page;
 		}
@@ -1411,7 +4020,7 @@ HL_API void hl_gc_dump_memory( const char *filename ) {
 	// roots
 	fdump_i(gc_roots_count);
 	for(i=0;i<gc_roots_count;i++)
-		fdump_p(*gc_roots[i]);
+		fdump_p(GC_ROOT_FREE(gc_roots[i]) ? NULL : *gc_roots[i]);
 	// stacks
 	fdump_i(gc_threads.count);
 	for(i=0;i<gc_threads.count;i++) {
@@ -1439,6 +4048,389 @@ HL_API void hl_gc_dump_memory( const char *filename ) {
 	gc_global_lock(false);
 }
 
+// heap snapshot : "HMS1" and the word size, then records made of a tag byte and LEB128 varints, with the addresses
+// divided by the word size. only the blocks marked by the snapshot collection are written
+//	'T' id kind name		type of the next blocks, the name is a length and UTF-8 (id 0 : none)
+//	'P' base kind			page of the next blocks, which follow by increasing address
+//	'B' delta size type n refs	block at delta from the previous one (or the page base), with
+//							the zigzag delta from the block to each live block it references
+//	'R' kind thread addr		root (0 global, 1 thread stack or registers, 2 arena)
+//	'X' blocks refs types roots bytes pages (base offset)*	index, the offsets are from the file start
+// the file ends with the 64 bits little-endian offset of the 'X' record
+#define GC_SNAP_BUFFER	(1 << 16)
+
+typedef struct {
+	hl_type *t;
+	int id;
+} gc_snap_type;
+
+// everything is allocated before writing : a forked writer only uses async-signal-safe calls
+typedef struct {
+	FILE *f;
+	int fd; // used instead of f if >= 0
+	bool error;
+	unsigned char buf[GC_SNAP_BUFFER];
+	int pos;
+	int64 offset;
+	gc_snap_type *types; // open addressing, filled by snap_alloc
+	int types_size;
+	int types_used;
+	int types_count; // written
+	int_val *pages; // base, offset pairs
+	int pages_count;
+	int pages_max;
+	int64 blocks;
+	int64 refs;
+	int64 roots;
+	int64 bytes;
+} gc_snapshot;
+
+static void snap_flush( gc_snapshot *s ) {
+#	ifdef GC_SNAPSHOT_FORK
+	if( s->fd >= 0 ) {
+		unsigned char *buf = s->buf;
+		int len = s->pos;
+		while( len > 0 ) {
+			ssize_t n = write(s->fd, buf, len);
+			if( n < 0 && errno == EINTR ) continue;
+			if( n <= 0 ) {
+				s->error = true;
+				break;
+			}
+			buf += n;
+			len -= (int)n;
+		}
+	} else
+#	endif
+	if( (int)fwrite(s->buf,1,s->pos,s->f) != s->pos )
+		s->error = true;
+	s->pos = 0;
+}
+
+static void snap_byte( gc_snapshot *s, int b ) {
+	if( s->pos == GC_SNAP_BUFFER )
+		snap_flush(s);
+	s->buf[s->pos++] = (unsigned char)b;
+	s->offset++;
+}
+
+static void snap_u( gc_snapshot *s, uint64 v ) {
+	while( v >= 0x80 ) {
+		snap_byte(s, (int)(v & 0x7F) | 0x80);
+		v >>= 7;
+	}
+	snap_byte(s, (int)v);
+}
+
+static void snap_addr( gc_snapshot *s, void *p ) {
+	snap_u(s, (uint64)(int_val)p / HL_WSIZE);
+}
+
+static void snap_name( gc_snapshot *s, const uchar *name ) {
+	unsigned char tmp[256];
+	int i, len = 0;
+	while( name && *name && len < 252 ) {
+		unsigned int c = *name++;
+		if( c >= 0xD800 && c < 0xDC00 && *name >= 0xDC00 && *name < 0xE000 )
+			c = (((c - 0xD800) << 10) | (*name++ - 0xDC00)) + 0x10000;
+		if( c < 0x80 )
+			tmp[len++] = (unsigned char)c;
+		else if( c < 0x800 ) {
+			tmp[len++] = (unsigned char)(0xC0 | (c >> 6));
+			tmp[len++] = (unsigned char)(0x80 | (c & 63));
+		} else if( c < 0x10000 ) {
+			tmp[len++] = (unsigned char)(0xE0 | (c >> 12));
+			tmp[len++] = (unsigned char)(0x80 | ((c >> 6) & 63));
+			tmp[len++] = (unsigned char)(0x80 | (c & 63));
+		} else {
+			tmp[len++] = (unsigned char)(0xF0 | (c >> 18));
+			tmp[len++] = (unsigned char)(0x80 | ((c >> 12) & 63));
+			tmp[len++] = (unsigned char)(0x80 | ((c >> 6) & 63));
+			tmp[len++] = (unsigned char)(0x80 | (c & 63));
+		}
+	}
+	snap_u(s, len);
+	for(i=0;i<len;i++)
+		snap_byte(s, tmp[i]);
+}
+
+static gc_snap_type *snap_type_slot( gc_snapshot *s, hl_type *t ) {
+	int h = (int)(((uint64)(int_val)t * 0x9E3779B97F4A7C15ULL) >> 40) & (s->types_size - 1);
+	while( s->types[h].t && s->types[h].t != t )
+		h = (h + 1) & (s->types_size - 1);
+	return s->types + h;
+}
+
+static bool snap_type_add( gc_snapshot *s, hl_type *t ) {
+	gc_snap_type *e;
+	if( (s->types_used + 1) * 2 > s->types_size ) {
+		gc_snap_type *old = s->types;
+		int i, osize = s->types_size;
+		gc_snap_type *types = (gc_snap_type*)calloc(osize ? osize << 1 : 256, sizeof(gc_snap_type));
+		if( types == NULL ) return false;
+		s->types = types;
+		s->types_size = osize ? osize << 1 : 256;
+		for(i=0;i<osize;i++)
+			if( old[i].t ) *snap_type_slot(s, old[i].t) = old[i];
+		free(old);
+	}
+	e = snap_type_slot(s, t);
+	if( !e->t ) {
+		e->t = t;
+		s->types_used++;
+	}
+	return true;
+}
+
+// returns the id of a type, which is written the first time
+static int snap_type( gc_snapshot *s, hl_type *t ) {
+	gc_snap_type *e;
+	const uchar *name = NULL;
+	if( t == NULL || s->types_size == 0 ) return 0;
+	e = snap_type_slot(s, t);
+	if( e->t == NULL ) return 0; // not found by snap_alloc
+	if( e->id ) return e->id;
+	e->id = ++s->types_count;
+	switch( t->kind ) {
+	case HOBJ:
+	case HSTRUCT:
+		if( t->obj ) name = t->obj->name;
+		break;
+	case HENUM:
+		if( t->tenum ) name = t->tenum->name;
+		break;
+	case HABSTRACT:
+		name = t->abs_name;
+		break;
+	default:
+		break;
+	}
+	snap_byte(s, 'T');
+	snap_u(s, e->id);
+	snap_u(s, (unsigned)t->kind < HLAST ? t->kind : HLAST);
+	snap_name(s, name);
+	return e->id;
+}
+
+// the start of the live block p points to, using the same rules as the mark
+static void *snap_live( void *p ) {
+	gc_pheader *page = GC_GET_PAGE(p);
+	int bid;
+	if( !page || !INPAGE(p,page) || (bid = gc_block_start(page,p)) < 0 ) return NULL;
+	if( page->sizes ) {
+		if( page->sizes[bid] == 0 ) return NULL;
+	} else if( bid < page->first_block )
+		return NULL;
+	if( !GC_PAGE_MARKED(page) || (page->bmp[bid>>3] & (1<<(bid&7))) == 0 ) return NULL;
+	return p;
+}
+
+static void snap_roots( gc_snapshot *s, void **start, void **end, int kind, int thread ) {
+	while( start < end ) {
+		void *p = snap_live(*start++);
+		if( !p ) continue;
+		snap_byte(s, 'R');
+		snap_u(s, kind);
+		snap_u(s, thread);
+		snap_addr(s, p);
+		s->roots++;
+	}
+}
+
+static void snap_page( gc_snapshot *s, gc_pheader *p ) {
+	unsigned char *prev = p->base;
+	int bid;
+	if( !GC_PAGE_MARKED(p) || s->pages_count == s->pages_max ) return;
+	s->pages[s->pages_count * 2] = (int_val)p->base;
+	s->pages[s->pages_count * 2 + 1] = (int_val)s->offset;
+	s->pages_count++;
+	snap_byte(s, 'P');
+	snap_addr(s, p->base);
+	snap_u(s, p->page_kind);
+	for(bid=p->first_block;bid<p->max_blocks;bid++) {
+		unsigned char *block;
+		int size, type, nrefs = 0;
+		void **cur, **end;
+		if( (p->bmp[bid>>3] & (1<<(bid&7))) == 0 ) continue;
+		block = p->base + bid * p->block_size;
+		size = p->sizes ? p->sizes[bid] * p->block_size : p->block_size;
+		type = p->page_kind == MEM_KIND_DYNAMIC ? snap_type(s, *(hl_type**)block) : 0;
+		cur = (void**)block;
+		end = (void**)(block + size);
+		if( MEM_HAS_PTR(p->page_kind) )
+			while( cur < end )
+				if( snap_live(*cur++) ) nrefs++;
+		snap_byte(s, 'B');
+		snap_u(s, (block - prev) / HL_WSIZE);
+		snap_u(s, size / HL_WSIZE);
+		snap_u(s, type);
+		snap_u(s, nrefs);
+		for(cur=(void**)block;nrefs>0;cur++) {
+			void *r = snap_live(*cur);
+			if( !r ) continue;
+			int64 d = ((int_val)r - (int_val)block) / HL_WSIZE;
+			snap_u(s, ((uint64)d << 1) ^ (uint64)(d >> 63));
+			nrefs--;
+			s->refs++;
+		}
+		s->blocks++;
+		s->bytes += size;
+		prev = block;
+		if( p->sizes ) bid += p->sizes[bid] - 1;
+	}
+}
+
+static void snap_free( gc_snapshot *s ) {
+	free(s->types);
+	free(s->pages);
+	free(s);
+}
+
+// with the world stopped after the mark : the pages index and the types table are sized from the heap
+static gc_snapshot *snap_alloc() {
+	gc_snapshot *s = (gc_snapshot*)calloc(1, sizeof(gc_snapshot));
+	int pid;
+	if( s == NULL ) return NULL;
+	s->fd = -1;
+	for(pid=0;pid<GC_ALL_PAGES;pid++) {
+		gc_pheader *p;
+		for(p=gc_pages[pid];p;p=p->next_page)
+			if( GC_PAGE_MARKED(p) ) s->pages_max++;
+	}
+	s->pages = (int_val*)malloc(sizeof(int_val) * 2 * (s->pages_max + 1));
+	if( s->pages == NULL || !snap_type_add(s, &hlt_dyn) ) {
+		snap_free(s);
+		return NULL;
+	}
+	for(pid=0;pid<GC_ALL_PAGES;pid++) {
+		gc_pheader *p;
+		if( (pid & PAGE_KIND_MASK) != MEM_KIND_DYNAMIC ) continue;
+		for(p=gc_pages[pid];p;p=p->next_page) {
+			int bid;
+			if( !GC_PAGE_MARKED(p) ) continue;
+			for(bid=p->first_block;bid<p->max_blocks;bid++) {
+				hl_type *t;
+				if( (p->bmp[bid>>3] & (1<<(bid&7))) == 0 ) continue;
+				t = *(hl_type**)(p->base + bid * p->block_size);
+				if( t && !snap_type_add(s, t) ) {
+					snap_free(s);
+					return NULL;
+				}
+				if( p->sizes ) bid += p->sizes[bid] - 1;
+			}
+		}
+	}
+	return s;
+}
+
+static bool snap_write( gc_snapshot *s ) {
+	hl_arena *a;
+	int64 index;
+	int i;
+	snap_byte(s, 'H');
+	snap_byte(s, 'M');
+	snap_byte(s, 'S');
+	snap_byte(s, '1');
+	snap_byte(s, HL_WSIZE);
+	for(i=0;i<GC_ALL_PAGES;i++) {
+		gc_pheader *p;
+		for(p=gc_pages[i];p;p=p->next_page)
+			snap_page(s, p);
+	}
+	for(i=0;i<gc_roots_count;i++)
+		if( !GC_ROOT_FREE(gc_roots[i]) )
+			snap_roots(s, gc_roots[i], gc_roots[i] + 1, 0, 0);
+	for(i=0;i<gc_threads.count;i++) {
+		hl_thread_info *t = gc_threads.threads[i];
+		gc_local *l = (gc_local*)t->gc_local;
+		int k;
+		for(k=0;k<l->roots_count;k++)
+			snap_roots(s, l->roots[k], l->roots[k] + 1, 0, 0);
+		snap_roots(s, (void**)t->stack_cur, (void**)t->stack_top, 1, i);
+		snap_roots(s, (void**)&t->gc_regs, (void**)(&t->gc_regs + 1), 1, i);
+	}
+	// the arenas are scanned as roots by the mark
+	for(a=gc_arenas;a;a=a->next) {
+		hl_alloc_block *b;
+		for(b=a->alloc.cur;b;b=b->next)
+			snap_roots(s, (void**)(b + 1), (void**)b->p, 2, 0);
+	}
+	index = s->offset;
+	snap_byte(s, 'X');
+	snap_u(s, s->blocks);
+	snap_u(s, s->refs);
+	snap_u(s, s->types_count);
+	snap_u(s, s->roots);
+	snap_u(s, s->bytes);
+	snap_u(s, s->pages_count);
+	for(i=0;i<s->pages_count;i++) {
+		snap_addr(s, (void*)s->pages[i * 2]);
+		snap_u(s, s->pages[i * 2 + 1]);
+	}
+	for(i=0;i<8;i++)
+		snap_byte(s, (int)(index >> (i * 8)) & 0xFF);
+	snap_flush(s);
+	return !s->error;
+}
+
+// collect and write a heap snapshot. in background, a forked process writes it while we continue,
+// it is written to filename.tmp and renamed once complete
+HL_API bool hl_gc_snapshot( const char *filename, bool background ) {
+	bool ok = false;
+	gc_snapshot *s;
+	int64 time, dt;
+	int64 phases[GC_PHASES * 2];
+	gc_global_lock(true);
+	gc_sweep_pages(0);
+	memcpy(phases, &gc_phases, sizeof(phases));
+	memset(gc_phases.last, 0, sizeof(gc_phases.last));
+	time = gc_clock();
+	gc_stop_world(true);
+	gc_snapshot_mark = true;
+	gc_mark(false);
+	gc_snapshot_mark = false;
+	dt = gc_clock() - time;
+	s = snap_alloc();
+#	ifdef GC_SNAPSHOT_FORK
+	if( s && background ) {
+		char tmp[1024];
+		int len = (int)strlen(filename);
+		// the name is not truncated : an error is returned if it is too long
+		if( len + 5 <= (int)sizeof(tmp) ) {
+			memcpy(tmp, filename, len);
+			memcpy(tmp + len, ".tmp", 5);
+			s->fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		}
+		if( s->fd >= 0 ) {
+			pid_t pid = fork();
+			if( pid == 0 ) {
+				// detach the writer so we don't have to wait for it, other threads might have
+				// been holding libc locks when forking so it only uses async-signal-safe calls
+				if( fork() == 0 )
+					_exit(snap_write(s) && close(s->fd) == 0 && rename(tmp, filename) == 0 ? 0 : 1);
+				_exit(0);
+			}
+			close(s->fd);
+			ok = pid > 0 && waitpid(pid, NULL, 0) == pid;
+		}
+	} else
+#	endif
+	if( s ) {
+		s->f = fopen(filename,"wb");
+		if( s->f ) {
+			ok = snap_write(s);
+			if( fclose(s->f) != 0 ) ok = false;
+		}
+	}
+	if( s ) snap_free(s);
+	gc_stop_world(false);
+	gc_mark_stats(false, dt);
+	// the phase times of the last collection are kept
+	memcpy(&gc_phases, phases, sizeof(phases));
+	gc_global_lock(false);
+	return ok;
+}
+
 #ifdef HL_VCC
 #	pragma optimize( "", off )
 #endif
@@ -1453,7 +4445,25 @@ DEFINE_PRIM(_VOID, gc_major, _NO_ARG);
 DEFINE_PRIM(_VOID, gc_enable, _BOOL);
 DEFINE_PRIM(_VOID, gc_profile, _BOOL);
 DEFINE_PRIM(_VOID, gc_stats, _REF(_F64) _REF(_F64) _REF(_F64));
+DEFINE_PRIM(_VOID, gc_page_stats, _REF(_F64) _REF(_F64) _REF(_F64));
+DEFINE_PRIM(_VOID, gc_set_retention, _F64);
+DEFINE_PRIM(_BOOL, gc_set_pause_target, _F64);
+DEFINE_PRIM(_VOID, gc_set_pacing, _I32 _F64);
+DEFINE_PRIM(_VOID, gc_set_compaction, _I32);
+DEFINE_PRIM(_VOID, gc_set_census, _I32);
+DEFINE_PRIM(_I32, gc_census_count, _REF(_I32));
+DEFINE_PRIM(_BOOL, gc_census_entry, _I32 _REF(_TYPE) _REF(_F64) _REF(_F64));
+DEFINE_PRIM(_VOID, gc_flush_finalizers, _NO_ARG);
+DEFINE_PRIM(_ABSTRACT(hl_weak), gc_alloc_weak, _DYN);
+DEFINE_PRIM(_DYN, gc_weak_get, _ABSTRACT(hl_weak));
+DEFINE_PRIM(_ABSTRACT(hl_arena), gc_arena_alloc, _NO_ARG);
+DEFINE_PRIM(_ABSTRACT(hl_arena), gc_arena_set, _ABSTRACT(hl_arena));
+DEFINE_PRIM(_VOID, gc_arena_free, _ABSTRACT(hl_arena));
+DEFINE_PRIM(_F64, gc_arena_size, _ABSTRACT(hl_arena));
+DEFINE_PRIM(_I32, gc_pause_stats, _REF(_F64) _REF(_F64) _ARR);
+DEFINE_PRIM(_I32, gc_stats_ext, _BYTES _I32);
 DEFINE_PRIM(_VOID, gc_dump_memory, _BYTES);
+DEFINE_PRIM(_BOOL, gc_snapshot, _BYTES _BOOL);
 DEFINE_PRIM(_I32, gc_get_flags, _NO_ARG);
 DEFINE_PRIM(_VOID, gc_set_flags, _I32);
 DEFINE_PRIM(_DYN, debug_call, _I32 _DYN);
@@ -694,16 +694,116 @@ HL_API void hl_tls_free( hl_tls *l );
 #define MEM_KIND_FINALIZER	3
 #define MEM_ALIGN_DOUBLE	128
 #define MEM_ZERO			256
+#define MEM_ARENA			512 // can be allocated in the current thread arena
 
 HL_API void *hl_gc_alloc_gen( hl_type *t, int size, int flags );
-HL_API void hl_add_root( void *ptr );
+// returns a handle for hl_remove_root_handle (the result was void in previous versions)
+HL_API int hl_add_root( void *ptr );
 HL_API void hl_remove_root( void *ptr );
+HL_API void hl_remove_root_handle( int handle );
+HL_API void hl_push_root( void *ptr );
+HL_API void hl_pop_root( void );
 HL_API void hl_gc_major( void );
 HL_API bool hl_is_gc_ptr( void *ptr );
 
 HL_API void hl_blocking( bool b );
 HL_API bool hl_is_blocking( void );
 
+// generational GC card table, hashed by address : storing a GC pointer into an
+// already allocated block must dirty the card of the written address
+#define HL_GC_CARD_BITS		9
+#define HL_GC_CARDS			(1 << 20)
+HL_API unsigned char hl_gc_cards[HL_GC_CARDS];
+#define hl_gc_write_barrier(ptr)	(hl_gc_cards[((int_val)(ptr) >> HL_GC_CARD_BITS) & (HL_GC_CARDS - 1)] = 1)
+HL_API void hl_gc_write_barrier_range( void *ptr, int size );
+// the barrier mode must be chosen before any code is compiled or run (HL_GC_BARRIERS for HL/C),
+// the generational and incremental modes can't be enabled without it
+HL_API bool hl_gc_set_barriers( bool b );
+HL_API bool hl_gc_has_barriers( void );
+HL_API bool hl_gc_fix_barriers( void );
+HL_API bool hl_gc_set_generational( bool b );
+HL_API bool hl_gc_is_generational( void );
+HL_API bool hl_gc_set_pause_target( double ms );
+HL_API int hl_gc_pause_stats( double *total_ms, double *max_ms, varray *buckets );
+HL_API void hl_gc_set_retention( double ratio );
+HL_API void hl_gc_set_pacing( int growth, double limit );
+HL_API void hl_gc_set_census( int every );
+HL_API void hl_gc_set_compaction( int percent );
+HL_API int hl_gc_census_count( int *collection );
+HL_API bool hl_gc_census_entry( int index, hl_type **t, double *count, double *bytes );
+HL_API bool hl_gc_snapshot( const char *filename, bool background );
+
+typedef struct {
+	void *key;
+	vdynamic *value;
+} hl_ephemeron;
+HL_API void **hl_gc_alloc_weak( void *target );
+HL_API void *hl_gc_weak_get( void **w );
+HL_API hl_ephemeron *hl_gc_alloc_ephemerons( int count );
+HL_API void hl_gc_check_weak_target( void *target );
+
+typedef struct _hl_arena hl_arena;
+HL_API hl_arena *hl_gc_arena_alloc( void );
+HL_API hl_arena *hl_gc_arena_set( hl_arena *a );
+HL_API void hl_gc_arena_free( hl_arena *a );
+HL_API double hl_gc_arena_size( hl_arena *a );
+HL_API void hl_gc_page_stats( double *reserved, double *retained, double *released );
+HL_API void hl_gc_flush_finalizers( void );
+
+// values filled by hl_gc_stats_ext, times are in milliseconds
+typedef enum {
+	HL_GC_STAT_ALLOCATED,			// bytes allocated since startup
+	HL_GC_STAT_ALLOCATIONS,
+	HL_GC_STAT_MEMORY,				// bytes in GC pages
+	HL_GC_STAT_THREAD_ALLOCATED,	// bytes allocated by the calling thread
+	HL_GC_STAT_COLLECTIONS,
+	HL_GC_STAT_PAUSES,
+	HL_GC_STAT_PAUSE_TOTAL,
+	HL_GC_STAT_PAUSE_P50,			// over the last 1024 pauses
+	HL_GC_STAT_PAUSE_P99,
+	HL_GC_STAT_PAUSE_MAX,
+	HL_GC_STAT_ROOTS,				// phases of the last collection, roots and stacks are the share of
+									// the collecting thread when marking in parallel
+	HL_GC_STAT_STACKS,
+	HL_GC_STAT_MARK,
+	HL_GC_STAT_FINALIZE,
+	HL_GC_STAT_RELEASE,
+	HL_GC_STAT_TOTAL_ROOTS,			// phases of all collections
+	HL_GC_STAT_TOTAL_STACKS,
+	HL_GC_STAT_TOTAL_MARK,
+	HL_GC_STAT_TOTAL_FINALIZE,
+	HL_GC_STAT_TOTAL_RELEASE,
+	HL_GC_STAT_SCANNED,				// words examined by the last mark
+	HL_GC_STAT_BUDGET,				// bytes allowed between two collections
+	HL_GC_STAT_LIVE,				// live heap estimate of the pacer
+	HL_GC_STAT_TRIGGER,				// 0 growth, 1 allocation count, 2 soft limit, 3 forced
+	HL_GC_STAT_LIMITED,				// collections triggered by the soft limit
+	HL_GC_STAT_COMPACT_MOVED,		// bytes copied by compaction
+	HL_GC_STAT_COMPACT_RECLAIMED,	// bytes of pages emptied by compaction
+	HL_GC_STAT_COUNT
+} hl_gc_stat;
+HL_API int hl_gc_stats_ext( double *values, int count );
+
+// set while a collection waits for the threads to stop : code that can run for long
+// without allocating or blocking must poll it
+HL_API volatile int hl_gc_stop_request;
+HL_API void hl_gc_safepoint( void );
+#define hl_gc_poll()	if( hl_gc_stop_request ) hl_gc_safepoint()
+
+// JIT frames are scanned precisely : the JIT publishes the stack and frame pointers of the
+// function calling out to native code, and maps each call site return address to the frame
+// layout of its function (map < 0 : native to JIT entry, which saved the previous frame)
+#if defined(HL_THREADS) && defined(HL_LINUX) && defined(__x86_64__) && !defined(HL_CONSOLE)
+#	define HL_GC_STACK_MAPS
+typedef struct {
+	int ret;
+	int map;
+} hl_gc_stack_site;
+HL_API void **hl_gc_jit_frame( void );
+HL_API void hl_gc_register_code( unsigned char *code, int size, hl_gc_stack_site *sites, int nsites, unsigned int *maps );
+HL_API void hl_gc_unregister_code( unsigned char *code );
+#endif
+
 typedef void (*hl_types_dump)( void (*)( void *, int) );
 HL_API void hl_gc_set_dump_types( hl_types_dump tdump );
 
@@ -856,6 +956,7 @@ typedef struct {
 	volatile int gc_blocking;
 	void *stack_top;
 	void *stack_cur;
+	void *stack_jit[2]; // JIT frame calling out to native code when the context was saved
 	// exception handling
 	hl_trap_ctx *trap_current;
 	hl_trap_ctx *trap_uncaught;
@@ -866,6 +967,8 @@ typedef struct {
 	// extra
 	jmp_buf gc_regs;
 	void *exc_stack_trace[HL_EXC_MAX_STACK];
+	void *gc_local; // thread allocation cache, see alloc.c
+	void *track_local; // sampled allocations, see track.c
 } hl_thread_info;
 
 HL_API hl_thread_info *hl_get_thread();
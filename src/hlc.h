@@ -31,6 +31,16 @@
 #	define PAD_64_VAL
 #endif
 
+// pointer store into an existing block : the generational and incremental GC
+// can only be enabled if the program was compiled with HL_GC_BARRIERS
+#ifdef HL_GC_BARRIERS
+#	define hlc_set_ptr(dst,v)	{ (dst) = (v); hl_gc_write_barrier(&(dst)); }
+#else
+#	define hlc_set_ptr(dst,v)	(dst) = (v)
+#endif
+// at loop heads, so that a long running loop doesn't prevent collections
+#define hlc_poll()			hl_gc_poll()
+
 #ifdef HLC_BOOT
 
 // undefine some commonly used names that can clash with class/var name
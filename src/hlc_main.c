@@ -120,6 +120,12 @@ int main(int argc, char *argv[]) {
 	vclosure cl = { 0 };
 	sys_global_init();
 	hl_global_init();
+#	ifdef HL_GC_BARRIERS
+	hl_gc_set_barriers(true);
+	if( getenv("HL_GC_GENERATIONAL") ) hl_gc_set_generational(true);
+	if( getenv("HL_GC_PAUSE_TARGET") ) hl_gc_set_pause_target(atof(getenv("HL_GC_PAUSE_TARGET")));
+#	endif
+	hl_gc_fix_barriers();
 	hl_register_thread(&ret);
 	hl_setup_exception(hlc_resolve_symbol,hlc_capture_stack);
 	hl_setup_callbacks(hlc_static_call, hlc_get_wrapper);
@@ -299,6 +299,16 @@ struct jit_ctx {
 	int hl2c;
 	int longjump;
 	void *static_functions[8];
+	bool barriers; // the GC needs the write barriers, read when the context is allocated
+#	ifdef HL_GC_STACK_MAPS
+	int frameMap;
+	int nsites;
+	int maxSites;
+	int nmaps;
+	int maxMaps;
+	hl_gc_stack_site *sites;
+	unsigned int *maps;
+#	endif
 };
 
 #define jit_exit() { hl_debug_break(); exit(-1); }
@@ -660,6 +670,42 @@ static void op( jit_ctx *ctx, CpuOp o, preg *a, preg *b, bool mode64 ) {
 			}
 		}
 		break;
+	case ID2(RMEM,RCONST):
+		ERRIF( f->mem_const == 0 );
+		{
+			int mult = a->id & 0xF;
+			int regOrOffs = mult == 15 ? a->id >> 4 : a->id >> 8;
+			CpuReg reg = (a->id >> 4) & 0xF;
+			int_val cval = b->holds ? (int_val)b->holds : b->id;
+			ERRIF( mult == 15 );
+			if( reg > 7 ) r64 |= 1;
+			if( mult == 0 ) {
+				OP(f->mem_const);
+				if( regOrOffs == 0 && (reg&7) != Ebp ) {
+					MOD_RM(0,GET_RM(f->mem_const)-1,reg);
+					if( (reg&7) == Esp ) B(0x24);
+				} else if( IS_SBYTE(regOrOffs) ) {
+					MOD_RM(1,GET_RM(f->mem_const)-1,reg);
+					if( (reg&7) == Esp ) B(0x24);
+					B(regOrOffs);
+				} else {
+					MOD_RM(2,GET_RM(f->mem_const)-1,reg);
+					if( (reg&7) == Esp ) B(0x24);
+					W(regOrOffs);
+				}
+			} else {
+				int offset = (int)(int_val)a->holds;
+				if( regOrOffs > 7 ) r64 |= 2;
+				OP(f->mem_const);
+				MOD_RM(offset == 0 ? 0 : IS_SBYTE(offset) ? 1 : 2,GET_RM(f->mem_const)-1,4);
+				SIB(mult,regOrOffs,reg);
+				if( offset ) {
+					if( IS_SBYTE(offset) ) B(offset); else W(offset);
+				}
+			}
+			if( o == MOV8 ) B((int)cval); else W((int)cval);
+		}
+		break;
 	case ID2(RCPU, RMEM):
 	case ID2(RFPU, RMEM):
 		ERRIF( f->r_mem == 0 );
@@ -787,10 +833,6 @@ static void op( jit_ctx *ctx, CpuOp o, preg *a, preg *b, bool mode64 ) {
 	default:
 		ERRIF(1);
 	}
-	if( ctx->debug && ctx->f && o == CALL ) {
-		preg p;
-		op(ctx,MOV,pmem(&p,Esp,-HL_WSIZE),PEBP,true); // erase EIP (clean stack report)
-	}
 }
 
 static void op32( jit_ctx *ctx, CpuOp o, preg *a, preg *b ) {
@@ -1244,6 +1286,33 @@ static void copy_from( jit_ctx *ctx, preg *to, vreg *from ) {
 	copy(ctx,to,fetch(from),from->size);
 }
 
+/*
+	Generational GC barrier : dirty the card of an address we are about to store a pointer into.
+	No collection can occur before the store since we don't reach a GC point in between.
+	Only emitted if the barriers were enabled before compilation, the mode is then fixed.
+*/
+static void gc_write_barrier( jit_ctx *ctx, preg *addr ) {
+	preg p, pc;
+	preg *r;
+	if( !ctx->barriers ) return;
+	r = alloc_reg(ctx, RCPU);
+	op64(ctx, addr->kind == RMEM ? LEA : MOV, r, addr);
+	op64(ctx, SHR, r, pconst(&pc,HL_GC_CARD_BITS));
+	op64(ctx, AND, r, pconst(&pc,HL_GC_CARDS - 1));
+#	ifdef HL_64
+	{
+		preg *t = alloc_reg(ctx, RCPU);
+		op64(ctx, MOV, t, pconst64(&pc,(int_val)hl_gc_cards));
+		op32(ctx, MOV8, pmem2(&p,t->id,r->id,1,0), pconst(&pc,1));
+		RUNLOCK(t);
+	}
+#	else
+	op32(ctx, ADD, r, pconst(&pc,(int)(int_val)hl_gc_cards));
+	op32(ctx, MOV8, pmem(&p,r->id,0), pconst(&pc,1));
+#	endif
+	RUNLOCK(r);
+}
+
 static void store_const( jit_ctx *ctx, vreg *r, int c ) {
 	preg p;
 	if( r->size > 4 )
@@ -1273,6 +1342,87 @@ static void discard_regs( jit_ctx *ctx, bool native_call ) {
 	}
 }
 
+#ifdef HL_GC_STACK_MAPS
+static int jit_frame_offset = 0; // hl_gc_jit_frame() relative to the thread pointer, 0 if unknown
+
+// mov fs:[frame + index], reg
+static void jit_frame_store( jit_ctx *ctx, int index, CpuReg r ) {
+	B(0x64);
+	B(0x48);
+	B(0x89);
+	B(0x04 | (r << 3));
+	B(0x25);
+	W(jit_frame_offset + index * HL_WSIZE);
+}
+
+// mov fs:[frame], 0
+static void jit_frame_clear( jit_ctx *ctx ) {
+	B(0x64);
+	B(0x48);
+	B(0xC7);
+	B(0x04);
+	B(0x25);
+	W(jit_frame_offset);
+	W(0);
+}
+
+// push fs:[frame + index]
+static void jit_frame_push( jit_ctx *ctx, int index ) {
+	B(0x64);
+	B(0xFF);
+	B(0x34);
+	B(0x25);
+	W(jit_frame_offset + index * HL_WSIZE);
+}
+
+// push [ebp + offset] ; pop fs:[frame + index]
+static void jit_frame_restore( jit_ctx *ctx, int index, int offset ) {
+	B(0xFF);
+	B(0x75);
+	B(offset);
+	B(0x64);
+	B(0x8F);
+	B(0x04);
+	B(0x25);
+	W(jit_frame_offset + index * HL_WSIZE);
+}
+
+static void jit_add_site( jit_ctx *ctx, int map ) {
+	if( ctx->nsites == ctx->maxSites ) {
+		ctx->maxSites = ctx->maxSites ? ctx->maxSites << 1 : 256;
+		ctx->sites = (hl_gc_stack_site*)realloc(ctx->sites, sizeof(hl_gc_stack_site) * ctx->maxSites);
+		if( ctx->sites == NULL ) ASSERT(ctx->maxSites);
+	}
+	ctx->sites[ctx->nsites].ret = BUF_POS();
+	ctx->sites[ctx->nsites].map = map;
+	ctx->nsites++;
+}
+
+// the pointer slots of the frame : all its call sites share them since every vreg keeps its stack slot
+static void jit_frame_map( jit_ctx *ctx, int size ) {
+	int i, words = size / HL_WSIZE, nbits = (words + 31) >> 5;
+	unsigned int *map;
+	if( ctx->nmaps + 1 + nbits > ctx->maxMaps ) {
+		while( ctx->nmaps + 1 + nbits > ctx->maxMaps )
+			ctx->maxMaps = ctx->maxMaps ? ctx->maxMaps << 1 : 1024;
+		ctx->maps = (unsigned int*)realloc(ctx->maps, sizeof(int) * ctx->maxMaps);
+		if( ctx->maps == NULL ) ASSERT(ctx->maxMaps);
+	}
+	ctx->frameMap = ctx->nmaps;
+	map = ctx->maps + ctx->nmaps;
+	ctx->nmaps += 1 + nbits;
+	map[0] = words;
+	memset(map + 1, 0, nbits * sizeof(int));
+	for(i=0;i<ctx->f->nregs;i++) {
+		vreg *r = R(i);
+		if( r->stackPos < 0 && hl_is_ptr(r->t) ) {
+			int k = words + r->stackPos / HL_WSIZE;
+			map[1 + (k >> 5)] |= 1u << (k & 31);
+		}
+	}
+}
+#endif
+
 static int pad_before_call( jit_ctx *ctx, int size ) {
 	int total = size + ctx->totalRegsSize + HL_WSIZE * 2; // EIP+EBP
 	if( total & 15 ) {
@@ -1469,7 +1619,26 @@ static void op_call( jit_ctx *ctx, preg *r, int size ) {
 		op64(ctx,SUB,PESP,pconst(&p,32));
 		if( size >= 0 ) size += 32;
 	}
+#	ifdef HL_GC_STACK_MAPS
+	// calls to JIT functions are resolved statically, others might reach native code
+	// and publish our frame for the GC until they return
+	bool native = ctx->f && r->kind != RCONST && jit_frame_offset;
+	if( native ) {
+		jit_frame_store(ctx, 0, Esp);
+		jit_frame_store(ctx, 1, Ebp);
+	}
+#	endif
 	op32(ctx, CALL, r, UNUSED);
+#	ifdef HL_GC_STACK_MAPS
+	if( ctx->f && jit_frame_offset ) jit_add_site(ctx, ctx->frameMap);
+#	endif
+	if( ctx->debug && ctx->f ) {
+		preg p;
+		op(ctx,MOV,pmem(&p,Esp,-HL_WSIZE),PEBP,true); // erase EIP (clean stack report)
+	}
+#	ifdef HL_GC_STACK_MAPS
+	if( native && size >= 0 ) jit_frame_clear(ctx);
+#	endif
 	if( size > 0 ) op64(ctx,ADD,PESP,pconst(&p,size));
 }
 
@@ -1484,6 +1653,18 @@ static void call_native( jit_ctx *ctx, void *nativeFun, int size ) {
 	discard_regs(ctx, true);
 }
 
+// must be called with no register in use
+static void gc_safepoint_poll( jit_ctx *ctx ) {
+	preg p;
+	int jskip;
+	op64(ctx, MOV, PEAX, pconst64(&p,(int_val)&hl_gc_stop_request));
+	op32(ctx, MOV, PEAX, pmem(&p,Eax,0));
+	op32(ctx, TEST, PEAX, PEAX);
+	XJump(JZero,jskip);
+	call_native(ctx, hl_gc_safepoint, begin_native_call(ctx, 0));
+	patch_jump(ctx,jskip);
+}
+
 static void op_call_fun( jit_ctx *ctx, vreg *dst, int findex, int count, int *args ) {
 	int fid = findex < 0 ? -1 : ctx->m->functions_indexes[findex];
 	bool isNative = fid >= ctx->m->code->nfunctions;
@@ -2197,6 +2378,7 @@ jit_ctx *hl_jit_alloc() {
 	memset(ctx,0,sizeof(jit_ctx));
 	hl_alloc_init(&ctx->falloc);
 	hl_alloc_init(&ctx->galloc);
+	ctx->barriers = hl_gc_fix_barriers();
 	for(i=0;i<RCPU_COUNT;i++) {
 		preg *r = REG_AT(i);
 		r->id = i;
@@ -2226,6 +2408,14 @@ void hl_jit_free( jit_ctx *ctx, h_bool can_reset ) {
 	ctx->closure_list = NULL;
 	hl_free(&ctx->falloc);
 	hl_free(&ctx->galloc);
+#	ifdef HL_GC_STACK_MAPS
+	free(ctx->sites);
+	free(ctx->maps);
+	ctx->sites = NULL;
+	ctx->maps = NULL;
+	ctx->nsites = ctx->maxSites = 0;
+	ctx->nmaps = ctx->maxMaps = 0;
+#	endif
 	if( !can_reset ) free(ctx);
 }
 
@@ -2356,6 +2546,14 @@ static void jit_c2hl( jit_ctx *ctx ) {
 	op64(ctx,PUSH,PEBP,UNUSED);
 	op64(ctx,MOV,PEBP,PESP);
 
+#	ifdef HL_GC_STACK_MAPS
+	// save the frame that was calling out, for the GC and until we return
+	if( jit_frame_offset ) {
+		jit_frame_push(ctx, 0);
+		jit_frame_push(ctx, 1);
+	}
+#	endif
+
 #	ifdef HL_64
 	
 	fptr = REG_AT(R10);
@@ -2407,6 +2605,14 @@ static void jit_c2hl( jit_ctx *ctx ) {
 
 	op_call(ctx,fptr,0);
 
+#	ifdef HL_GC_STACK_MAPS
+	if( jit_frame_offset ) {
+		jit_add_site(ctx, -1);
+		jit_frame_restore(ctx, 0, -HL_WSIZE);
+		jit_frame_restore(ctx, 1, -HL_WSIZE * 2);
+	}
+#	endif
+
 	// cleanup and ret
 	op64(ctx,MOV,PESP,PEBP);
 	op64(ctx,POP,PEBP, UNUSED);
@@ -2591,6 +2797,7 @@ static void jit_assert( jit_ctx *ctx ) {
 
 static int jit_build( jit_ctx *ctx, void (*fbuild)( jit_ctx *) ) {
 	int pos;
+	ctx->f = NULL;
 	jit_buf(ctx);
 	jit_nops(ctx);
 	pos = BUF_POS();
@@ -2612,6 +2819,14 @@ static void hl_jit_init_module( jit_ctx *ctx, hl_module *m ) {
 
 void hl_jit_init( jit_ctx *ctx, hl_module *m ) {
 	hl_jit_init_module(ctx,m);
+#	ifdef HL_GC_STACK_MAPS
+	if( !jit_frame_offset ) {
+		int_val tp, offset;
+		__asm__("mov %%fs:0, %0" : "=r"(tp));
+		offset = (int_val)hl_gc_jit_frame() - tp;
+		if( (int)offset == offset ) jit_frame_offset = (int)offset;
+	}
+#	endif
 	ctx->c2hl = jit_build(ctx, jit_c2hl);
 	ctx->hl2c = jit_build(ctx, jit_hl2c);
 #	ifdef JIT_CUSTOM_LONGJUMP
@@ -2791,6 +3006,9 @@ int hl_jit_function( jit_ctx *ctx, hl_module *m, hl_function *f ) {
 	size += hl_pad_size(size,&hlt_dyn); // align on word size
 #	endif
 	ctx->totalRegsSize = size;
+#	ifdef HL_GC_STACK_MAPS
+	if( jit_frame_offset ) jit_frame_map(ctx, size);
+#	endif
 	jit_buf(ctx);
 	ctx->functionPos = BUF_POS();
 	op_enter(ctx);
@@ -3328,6 +3546,8 @@ int hl_jit_function( jit_ctx *ctx, hl_module *m, hl_function *f ) {
 					{
 						hl_runtime_obj *rt = hl_get_obj_rt(dst->t);
 						preg *rr = alloc_cpu(ctx, dst, true);
+						if( hl_is_ptr(rb->t) )
+							gc_write_barrier(ctx, pmem(&p, (CpuReg)rr->id, rt->fields_indexes[o->p2]));
 						copy_from(ctx, pmem(&p, (CpuReg)rr->id, rt->fields_indexes[o->p2]), rb);
 					}
 					break;
@@ -3379,6 +3599,8 @@ int hl_jit_function( jit_ctx *ctx, hl_module *m, hl_function *f ) {
 						call_native(ctx,get_dynset(rb->t),size);
 						XJump_small(JAlways,jend);
 						patch_jump(ctx,jhasfield);
+						if( hl_is_ptr(rb->t) )
+							gc_write_barrier(ctx, r);
 						copy_from(ctx, pmem(&p,(CpuReg)r->id,0), rb);
 						patch_jump(ctx,jend);
 						scratch(rb->current);
@@ -3403,6 +3625,8 @@ int hl_jit_function( jit_ctx *ctx, hl_module *m, hl_function *f ) {
 				vreg *r = R(0);
 				hl_runtime_obj *rt = hl_get_obj_rt(r->t);
 				preg *rr = alloc_cpu(ctx, r, true);
+				if( hl_is_ptr(ra->t) )
+					gc_write_barrier(ctx, pmem(&p, (CpuReg)rr->id, rt->fields_indexes[o->p1]));
 				copy_from(ctx, pmem(&p, (CpuReg)rr->id, rt->fields_indexes[o->p1]), ra);
 			}
 			break;
@@ -3541,8 +3765,9 @@ int hl_jit_function( jit_ctx *ctx, hl_module *m, hl_function *f ) {
 			}
 			break;
 		case OLabel:
-			// NOP for now
+			// loop head : let the GC stop us
 			discard_regs(ctx,false);
+			gc_safepoint_poll(ctx);
 			break;
 		case OGetI8:
 		case OGetI16:
@@ -3632,7 +3857,10 @@ int hl_jit_function( jit_ctx *ctx, hl_module *m, hl_function *f ) {
 			break;
 		case OSetArray:
 			{
-				preg *rrb = IS_FLOAT(rb) ? alloc_fpu(ctx,rb,true) : alloc_cpu(ctx,rb,true);
+				preg *rrb;
+				if( hl_is_ptr(rb->t) )
+					gc_write_barrier(ctx, pmem2(&p,alloc_cpu(ctx,dst,true)->id,alloc_cpu64(ctx,ra,true)->id,hl_type_size(rb->t),sizeof(varray)));
+				rrb = IS_FLOAT(rb) ? alloc_fpu(ctx,rb,true) : alloc_cpu(ctx,rb,true);
 				copy(ctx, pmem2(&p,alloc_cpu(ctx,dst,true)->id,alloc_cpu64(ctx,ra,true)->id,hl_type_size(rb->t),sizeof(varray)), rrb, rb->size);
 			}
 			break;
@@ -3657,6 +3885,8 @@ int hl_jit_function( jit_ctx *ctx, hl_module *m, hl_function *f ) {
 			copy_to(ctx,dst,pmem(&p,alloc_cpu(ctx,ra,true)->id,0));
 			break;
 		case OSetref:
+			if( hl_is_ptr(ra->t) )
+				gc_write_barrier(ctx, alloc_cpu(ctx,dst,true));
 			copy_from(ctx,pmem(&p,alloc_cpu(ctx,dst,true)->id,0),ra);
 			break;
 		case ORefData:
@@ -3752,6 +3982,8 @@ int hl_jit_function( jit_ctx *ctx, hl_module *m, hl_function *f ) {
 			{
 				hl_enum_construct *c = &dst->t->tenum->constructs[0];
 				preg *r = alloc_cpu(ctx,dst,true);
+				if( hl_is_ptr(rb->t) )
+					gc_write_barrier(ctx, pmem(&p,r->id,c->offsets[o->p2]));
 				switch( rb->t->kind ) {
 				case HF64:
 					{
@@ -4213,6 +4445,16 @@ void *hl_jit_code( jit_ctx *ctx, hl_module *m, int *codesize, hl_debug_infos **d
 			c = next;
 		}
 	}
+#	ifdef HL_GC_STACK_MAPS
+	if( ctx->nsites ) {
+		// the GC keeps the maps
+		hl_gc_register_code(code, size, ctx->sites, ctx->nsites, ctx->maps);
+		ctx->sites = NULL;
+		ctx->maps = NULL;
+		ctx->nsites = ctx->maxSites = 0;
+		ctx->nmaps = ctx->maxMaps = 0;
+	}
+#	endif
 	return code;
 }
 
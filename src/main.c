@@ -196,6 +196,12 @@ int main(int argc, pchar *argv[]) {
 		}
 	}
 	hl_global_init();
+	// the write barriers required by the generational and incremental GC are only emitted by
+	// the JIT when one of them is requested at startup, these modes can't be enabled later
+	if( getenv("HL_GC_BARRIERS") || getenv("HL_GC_GENERATIONAL") || getenv("HL_GC_PAUSE_TARGET") )
+		hl_gc_set_barriers(true);
+	if( getenv("HL_GC_GENERATIONAL") ) hl_gc_set_generational(true);
+	if( getenv("HL_GC_PAUSE_TARGET") ) hl_gc_set_pause_target(atof(getenv("HL_GC_PAUSE_TARGET")));
 	hl_sys_init((void**)argv,argc,file);
 	hl_register_thread(&ctx);
 	ctx.file = file;
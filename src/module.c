@@ -679,6 +679,9 @@ h_bool hl_module_patch( hl_module *m1, hl_code *c ) {
 }
 
 void hl_module_free( hl_module *m ) {
+#	ifdef HL_GC_STACK_MAPS
+	if( m->jit_code ) hl_gc_unregister_code(m->jit_code);
+#	endif
 	hl_free(&m->ctx.alloc);
 	hl_free_executable_memory(m->code, m->codesize);
 	free(m->functions_indexes);
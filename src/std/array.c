@@ -25,7 +25,7 @@ HL_PRIM varray *hl_alloc_array( hl_type *at, int size ) {
 	int esize = hl_type_size(at);
 	varray *a;
 	if( size < 0 ) hl_error("Invalid array size");
-	a = (varray*)hl_gc_alloc_gen(&hlt_array, sizeof(varray) + esize*size, (hl_is_ptr(at) ? MEM_KIND_DYNAMIC : MEM_KIND_NOPTR) | MEM_ZERO);
+	a = (varray*)hl_gc_alloc_gen(&hlt_array, sizeof(varray) + esize*size, (hl_is_ptr(at) ? MEM_KIND_DYNAMIC : MEM_KIND_NOPTR) | MEM_ZERO | MEM_ARENA);
 	a->t = &hlt_array;
 	a->at = at;
 	a->size = size;
@@ -35,6 +35,7 @@ HL_PRIM varray *hl_alloc_array( hl_type *at, int size ) {
 HL_PRIM void hl_array_blit( varray *dst, int dpos, varray *src, int spos, int len ) {
 	int size = hl_type_size(dst->at); 
 	memmove( hl_aptr(dst,vbyte) + dpos * size, hl_aptr(src,vbyte) + spos * size, len * size); 
+	if( hl_is_ptr(dst->at) ) hl_gc_write_barrier_range(hl_aptr(dst,vbyte) + dpos * size, len * size);
 }
 
 HL_PRIM hl_type *hl_array_type( varray *a ) {
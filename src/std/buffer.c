@@ -61,6 +61,7 @@ static void buffer_append_new( hl_buffer *b, const uchar *s, int len ) {
 	it->len = len;
 	it->next = b->data;
 	b->data = it;
+	hl_gc_write_barrier(&b->data);
 }
 
 HL_PRIM void hl_buffer_str_sub( hl_buffer *b, const uchar *s, int len ) {
@@ -22,7 +22,7 @@
 #include <hl.h>
 
 HL_PRIM vbyte *hl_alloc_bytes( int size ) {
-	return (vbyte*)hl_gc_alloc_noptr(size);
+	return (vbyte*)hl_gc_alloc_gen(&hlt_bytes,size,MEM_KIND_NOPTR | MEM_ARENA);
 }
 
 HL_PRIM vbyte *hl_copy_bytes( const vbyte *ptr, int size ) {
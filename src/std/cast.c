@@ -414,6 +414,7 @@ HL_PRIM void hl_write_dyn( void *data, hl_type *t, vdynamic *v, bool is_tmp ) {
 				((vdynamic*)ret)->v = v->v;
 			}
 			*(void**)data = ret;
+			hl_gc_write_barrier(data);
 		}
 		break;
 	}
@@ -106,6 +106,9 @@ HL_PRIM void hl_throw( vdynamic *v ) {
 	t->flags &= ~HL_EXC_RETHROW;
 	if( t->exc_handler && call_handler ) hl_dyn_call_safe(t->exc_handler,&v,1,&call_handler);
 	if( throw_jump == NULL ) throw_jump = longjmp;
+#	ifdef HL_GC_STACK_MAPS
+	hl_gc_jit_frame()[0] = NULL; // the JIT frame calling out might be unwound
+#	endif
 	throw_jump(trap->buf,1);
 	HL_UNREACHABLE;
 }
@@ -45,6 +45,7 @@ static void hl_freelist_resize( hl_free_list *f, int newsize ) {
 	hl_free_bucket *buckets = (hl_free_bucket*)hl_gc_alloc_noptr(sizeof(hl_free_bucket)*newsize);
 	memcpy(buckets,f->buckets,f->head * sizeof(hl_free_bucket));
 	f->buckets = buckets;
+	hl_gc_write_barrier(&f->buckets);
 	f->nbuckets = newsize;
 }
 
@@ -177,7 +178,7 @@ typedef struct {
 #define _MNAME(n)	hl_hb##n
 #define _MMATCH(c)	m->entries[c].hash == hash && ucmp(m->values[c].key,key) == 0
 #define _MKEY(m,c)	m->values[c].key
-#define	_MSET(c)	m->entries[c].hash = hash; m->values[c].key = key
+#define	_MSET(c)	m->entries[c].hash = hash; m->values[c].key = key; hl_gc_write_barrier(&m->values[c].key)
 #define _MERASE(c)  m->values[c].key = NULL
 
 #include "maps.h"
@@ -220,8 +221,32 @@ static vdynamic *hl_hofilter( vdynamic *key ) {
 #define _MNAME(n)	hl_ho##n
 #define _MMATCH(c)	m->values[c].key == key
 #define _MKEY(m,c)	m->values[c].key
+#define	_MSET(c)	m->values[c].key = key; hl_gc_write_barrier(&m->values[c].key)
+#define _MERASE(c)  m->values[c].key = NULL
+
+#include "maps.h"
+
+// ----- WEAK OBJECT MAP ----------------------------
+// keys are held weakly : the values are ephemerons, only kept while their key is
+
+typedef struct {
+	int next;
+} hl_hw_entry;
+
+typedef hl_ephemeron hl_hw_value;
+
+#define hlt_key		hlt_dyn
+#define hl_hwfilter(key)	hl_hofilter(key)
+#define hl_hwhash(key)	((unsigned int)(int_val)(key))
+#define _MKEY_TYPE	vdynamic*
+#define _MNAME(n)	hl_hw##n
+#define _MMATCH(c)	key && m->values[c].key == key
+#define _MKEY(m,c)	((vdynamic*)m->values[c].key)
 #define	_MSET(c)	m->values[c].key = key
 #define _MERASE(c)  m->values[c].key = NULL
+#define _MWEAK
+#define _MDEAD(m,c)	((m)->values[c].key == NULL)
+#define _MALLOC_VALUES(size)	hl_gc_alloc_ephemerons((size) / sizeof(hl_ephemeron))
 
 #include "maps.h"
 
@@ -254,3 +279,13 @@ DEFINE_PRIM( _BOOL, horemove, _OMAP _DYN );
 DEFINE_PRIM( _ARR, hokeys, _OMAP );
 DEFINE_PRIM( _ARR, hovalues, _OMAP );
 DEFINE_PRIM( _VOID, hoclear, _OMAP );
+
+#define _WMAP _ABSTRACT(hl_weak_map)
+DEFINE_PRIM( _WMAP, hwalloc, _NO_ARG );
+DEFINE_PRIM( _VOID, hwset, _WMAP _DYN _DYN );
+DEFINE_PRIM( _BOOL, hwexists, _WMAP _DYN );
+DEFINE_PRIM( _DYN, hwget, _WMAP _DYN );
+DEFINE_PRIM( _BOOL, hwremove, _WMAP _DYN );
+DEFINE_PRIM( _ARR, hwkeys, _WMAP );
+DEFINE_PRIM( _ARR, hwvalues, _WMAP );
+DEFINE_PRIM( _VOID, hwclear, _WMAP );
@@ -7,6 +7,12 @@
 #define t_map _MNAME(_map)
 #define t_entry _MNAME(_entry)
 #define t_value _MNAME(_value)
+#ifndef _MALLOC_VALUES
+#	define _MALLOC_VALUES(size) hl_gc_alloc_raw(size)
+#endif
+#ifndef _MDEAD
+#	define _MDEAD(m,c) false
+#endif
 
 typedef struct {
 	int *cells;
@@ -41,6 +47,31 @@ static vdynamic **_MNAME(find)( t_map *m, t_key key ) {
 
 static void _MNAME(resize)( t_map *m );
 
+#ifdef _MWEAK
+// unlink the entries which key was collected
+static void _MNAME(purge)( t_map *m ) {
+	int i;
+	for(i=0;i<m->ncells;i++) {
+		int prev = -1;
+		int c = m->cells[i];
+		while( c >= 0 ) {
+			int next = m->entries[c].next;
+			if( _MDEAD(m,c) ) {
+				hl_freelist_add(&m->lfree,c);
+				m->nentries--;
+				m->values[c].value = NULL;
+				if( prev >= 0 )
+					m->entries[prev].next = next;
+				else
+					m->cells[i] = next;
+			} else
+				prev = c;
+			c = next;
+		}
+	}
+}
+#endif
+
 static void _MNAME(set_impl)( t_map *m, t_key key, vdynamic *value ) {
 	int c, ckey = 0;
 	unsigned int hash = _MNAME(hash)(key);
@@ -50,12 +81,19 @@ static void _MNAME(set_impl)( t_map *m, t_key key, vdynamic *value ) {
 		while( c >= 0 ) {
 			if( _MMATCH(c) ) {
 				m->values[c].value = value;
+				hl_gc_write_barrier(&m->values[c].value);
 				return;
 			}
 			c = m->entries[c].next;
 		}
 	}
 	c = hl_freelist_get(&m->lfree);
+#	ifdef _MWEAK
+	if( c < 0 ) {
+		_MNAME(purge)(m);
+		c = hl_freelist_get(&m->lfree);
+	}
+#	endif
 	if( c < 0 ) {
 		_MNAME(resize)(m);
 		ckey = hash % ((unsigned)m->ncells);
@@ -65,6 +103,7 @@ static void _MNAME(set_impl)( t_map *m, t_key key, vdynamic *value ) {
 	m->entries[c].next = m->cells[ckey];
 	m->cells[ckey] = c;
 	m->values[c].value = value;
+	hl_gc_write_barrier(&m->values[c].value);
 	m->nentries++;
 }
 
@@ -76,6 +115,7 @@ static void _MNAME(resize)( t_map *m ) {
 
 	// resize
 	int i = 0;
+	int root = -1;
 	int nentries = m->maxentries ? ((m->maxentries * 3) + 1) >> 1 : H_SIZE_INIT;
 	int ncells = nentries >> 2;
 
@@ -83,7 +123,9 @@ static void _MNAME(resize)( t_map *m ) {
 	ncells = H_PRIMES[i];
 
 	m->entries = (t_entry*)hl_gc_alloc_noptr(nentries * sizeof(t_entry));
-	m->values = (t_value*)hl_gc_alloc_raw(nentries * sizeof(t_value));
+	hl_gc_write_barrier(&m->entries);
+	m->values = (t_value*)_MALLOC_VALUES(nentries * sizeof(t_value));
+	hl_gc_write_barrier(&m->values);
 	m->maxentries = nentries;
 
 	if( old.ncells == ncells ) {
@@ -95,6 +137,7 @@ static void _MNAME(resize)( t_map *m ) {
 	} else {
 		// expand and remap
 		m->cells = (int*)hl_gc_alloc_noptr(ncells * sizeof(int));
+		hl_gc_write_barrier(&m->cells);
 		m->ncells = ncells;
 		m->nentries = 0;
 		memset(m->cells,0xFF,ncells * sizeof(int));
@@ -102,20 +145,32 @@ static void _MNAME(resize)( t_map *m ) {
 		hl_freelist_init(&m->lfree);
 		hl_freelist_add_range(&m->lfree,0,m->maxentries);
 
-		hl_add_root(&old); // prevent old.cells pointer aliasing
+		// prevent old.cells pointer aliasing, unregistered threads have no root stack
+		if( hl_get_thread() )
+			hl_push_root(&old);
+		else
+			root = hl_add_root(&old);
 		for(i=0;i<old.ncells;i++) {
 			int c = old.cells[i];
 			while( c >= 0 ) {
-				_MNAME(set_impl)(m,_MKEY((&old),c),old.values[c].value);
+				if( !_MDEAD((&old),c) )
+					_MNAME(set_impl)(m,_MKEY((&old),c),old.values[c].value);
 				c = old.entries[c].next;
 			}
 		}
-		hl_remove_root(&old);
+		if( root < 0 )
+			hl_pop_root();
+		else
+			hl_remove_root_handle(root);
 	}
 }
 
 HL_PRIM void _MNAME(set)( t_map *m, t_key key, vdynamic *value ) {
-	_MNAME(set_impl)(m,_MNAME(filter)(key),value);
+	key = _MNAME(filter)(key);
+#	ifdef _MWEAK
+	hl_gc_check_weak_target(key);
+#	endif
+	_MNAME(set_impl)(m,key,value);
 }
 
 HL_PRIM bool _MNAME(exists)( t_map *m, t_key key ) {
@@ -155,32 +210,45 @@ HL_PRIM bool _MNAME(remove)( t_map *m, t_key key ) {
 }
 
 HL_PRIM varray* _MNAME(keys)( t_map *m ) {
-	varray *a = hl_alloc_array(&hlt_key,m->nentries);
-	t_key *keys = hl_aptr(a,t_key);
+	varray *a;
+	t_key *keys;
 	int p = 0;
 	int i;
+#	ifdef _MWEAK
+	_MNAME(purge)(m);
+#	endif
+	a = hl_alloc_array(&hlt_key,m->nentries);
+	keys = hl_aptr(a,t_key);
 	for(i=0;i<m->ncells;i++) {
 		int c = m->cells[i];
 		while( c >= 0 ) {
-			keys[p++] = _MKEY(m,c);
+			if( !_MDEAD(m,c) ) keys[p++] = _MKEY(m,c);
 			c = m->entries[c].next;
 		}
 	}
+	// entries might have been collected by the array allocation
+	a->size = p;
 	return a;
 }
 
 HL_PRIM varray* _MNAME(values)( t_map *m ) {
-	varray *a = hl_alloc_array(&hlt_dyn,m->nentries);
-	vdynamic **values = hl_aptr(a,vdynamic*);
+	varray *a;
+	vdynamic **values;
 	int p = 0;
 	int i;
+#	ifdef _MWEAK
+	_MNAME(purge)(m);
+#	endif
+	a = hl_alloc_array(&hlt_dyn,m->nentries);
+	values = hl_aptr(a,vdynamic*);
 	for(i=0;i<m->ncells;i++) {
 		int c = m->cells[i];
 		while( c >= 0 ) {
-			values[p++] = m->values[c].value;
+			if( !_MDEAD(m,c) ) values[p++] = m->values[c].value;
 			c = m->entries[c].next;
 		}
 	}
+	a->size = p;
 	return a;
 }
 
@@ -198,4 +266,7 @@ HL_PRIM void _MNAME(clear)( t_map *m ) {
 #undef _MSET
 #undef _MERASE
 #undef _MOLD_KEY
+#undef _MALLOC_VALUES
+#undef _MDEAD
+#undef _MWEAK
 
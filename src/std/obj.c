@@ -472,6 +472,7 @@ vdynamic *hl_virtual_make_value( vvirtual *v ) {
 	memset(hl_vfields(v) + nfields, 0, v->t->virt->dataSize);
 	o->virtuals = v;
 	v->value = (vdynamic*)o;
+	hl_gc_write_barrier(&v->value);
 	return v->value;
 }
 
@@ -554,6 +555,7 @@ vvirtual *hl_to_virtual( hl_type *vt, vdynamic *obj ) {
 			// add it to the list
 			v->next = o->virtuals;
 			o->virtuals = v;
+			hl_gc_write_barrier(&o->virtuals);
 			// recast
 			if( need_recast ) {
 				for(i=0;i<vt->virt->nfields;i++)
@@ -600,6 +602,7 @@ static void hl_dynobj_delete_field( vdynobj *o, hl_field_lookup *f ) {
 	// erase data
 	if( is_ptr ) {
 		memmove(o->values + index, o->values + index + 1, (o->nvalues - (index + 1)) * sizeof(void*));
+		hl_gc_write_barrier_range(o->values + index, (o->nvalues - (index + 1)) * sizeof(void*));
 		o->nvalues--;
 		o->values[o->nvalues] = NULL;
 		for(i=0;i<o->nfields;i++) {
@@ -648,6 +651,7 @@ static hl_field_lookup *hl_dynobj_add_field( vdynobj *o, int hfield, hl_type *t
 		nvalues[index] = NULL;
 		address_offset = (char*)nvalues - (char*)o->values;
 		o->values = nvalues;
+		hl_gc_write_barrier(&o->values);
 		o->nvalues++;
 	} else {
 		int raw_size = 0;
@@ -682,6 +686,7 @@ static hl_field_lookup *hl_dynobj_add_field( vdynobj *o, int hfield, hl_type *t
 		}
 		address_offset = newData - o->raw_data;
 		o->raw_data = newData;
+		hl_gc_write_barrier(&o->raw_data);
 		o->raw_size += pad;
 		index = o->raw_size;
 		o->raw_size += size;
@@ -698,6 +703,7 @@ static hl_field_lookup *hl_dynobj_add_field( vdynobj *o, int hfield, hl_type *t
 	memcpy(new_lookup + (field_pos + 1),o->lookup + field_pos, (o->nfields - field_pos) * sizeof(hl_field_lookup));
 	o->nfields++;
 	o->lookup = new_lookup;
+	hl_gc_write_barrier(&o->lookup);
 
 	hl_dynobj_remap_virtuals(o, f, address_offset);
 	return f;
@@ -961,9 +967,10 @@ HL_PRIM void hl_dyn_setp( vdynamic *d, int hfield, hl_type *t, void *value ) {
 	hl_type *ft = NULL;
 	hl_track_call(HL_TRACK_DYNFIELD, on_dynfield(d,hfield));
 	void *addr = hl_obj_lookup_set(d,hfield,t,&ft);
-	if( hl_same_type(t,ft) || (hl_is_ptr(ft) && value == NULL) )
+	if( hl_same_type(t,ft) || (hl_is_ptr(ft) && value == NULL) ) {
 		*(void**)addr = value;
-	else if( hl_is_dynamic(t) )
+		hl_gc_write_barrier(addr);
+	} else if( hl_is_dynamic(t) )
 		hl_write_dyn(addr,ft,(vdynamic*)value,false);
 	else {
 		vdynamic tmp;
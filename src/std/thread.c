@@ -223,6 +223,7 @@ struct _hl_deque {
 	void (*free)( hl_deque * );
 	tqueue *first;
 	tqueue *last;
+	int root;
 #ifdef HL_THREADS
 #	ifdef HL_WIN
 	CRITICAL_SECTION lock;
@@ -249,7 +250,7 @@ struct _hl_deque {
 #endif
 
 static void hl_deque_free( hl_deque *q ) {
-	hl_remove_root(&q->first);
+	hl_remove_root_handle(q->root);
 #	if !defined(HL_THREADS)
 #	elif defined(HL_WIN)
 	DeleteCriticalSection(&q->lock);
@@ -265,7 +266,7 @@ HL_API hl_deque *hl_deque_alloc() {
 	q->free = hl_deque_free;
 	q->first = NULL;
 	q->last = NULL;
-	hl_add_root(&q->first);
+	q->root = hl_add_root(&q->first);
 #	if !defined(HL_THREADS)
 #	elif defined(HL_WIN)
 	q->wait = CreateSemaphore(NULL,0,(1 << 30),NULL);
@@ -284,9 +285,12 @@ HL_API void hl_deque_add( hl_deque *q, vdynamic *msg ) {
 	LOCK(q->lock);
 	if( q->last == NULL )
 		q->first = t;
-	else
+	else {
 		q->last->next = t;
+		hl_gc_write_barrier(&q->last->next);
+	}
 	q->last = t;
+	hl_gc_write_barrier(&q->last);
 	SIGNAL(q->wait);
 	UNLOCK(q->lock);
 }
@@ -299,6 +303,7 @@ HL_API void hl_deque_push( hl_deque *q, vdynamic *msg ) {
 	q->first = t;
 	if( q->last == NULL )
 		q->last = t;
+	hl_gc_write_barrier(&q->last);
 	SIGNAL(q->wait);
 	UNLOCK(q->lock);
 }
@@ -487,13 +492,14 @@ HL_PRIM int hl_thread_id() {
 typedef struct {
 	void (*callb)( void *);
 	void *param;
+	int root;
 } thread_start;
 
 #ifdef HL_THREADS
 static void gc_thread_entry( thread_start *_s ) {
 	thread_start s = *_s;
 	hl_register_thread(&s);
-	hl_remove_root(&_s->param);
+	hl_remove_root_handle(_s->root);
 	free(_s);
 	s.callb(s.param);
 	hl_unregister_thread();
@@ -506,7 +512,7 @@ HL_PRIM hl_thread *hl_thread_start( void *callback, void *param, bool withGC ) {
 		thread_start *s = (thread_start*)malloc(sizeof(thread_start));
 		s->callb = callback;
 		s->param = param;
-		hl_add_root(&s->param);
+		s->root = hl_add_root(&s->param);
 		callback = gc_thread_entry;
 		param = s;
 	}
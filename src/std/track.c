@@ -21,6 +21,7 @@
  */
 #include "hl.h"
 #include <stdio.h>
+#include <math.h>
 
 static int track_depth = 10;
 static int max_depth = 0;
@@ -43,6 +44,7 @@ typedef struct {
 	int stack_count;
 	int hit_count;
 	int info;
+	double bytes; // allocated bytes, estimated when sampling
 } bucket;
 
 typedef struct {
@@ -59,7 +61,50 @@ typedef struct {
 static bucket_list all_data[_KLAST] = {{0}};
 static hl_mutex *track_lock = NULL;
 
+// when sampling, an allocation is only recorded once the thread allocated sample_rate bytes on average
+// since the last sample, with exponentially distributed intervals so that each byte has the same chance
+// to be sampled ; the samples are buffered per thread and merged into the buckets with the lock held
+#define SAMPLE_DEPTH	32
+#define SAMPLE_RING		64
+
+#ifdef HL_WIN
+#	define SAMPLE_FENCE()	MemoryBarrier()
+#else
+#	define SAMPLE_FENCE()	__sync_synchronize()
+#endif
+
+typedef struct {
+	hl_type *t;
+	int size;
+	int count;
+	double weight;
+	void *stack[SAMPLE_DEPTH];
+} sample;
+
+typedef struct _sample_buffer sample_buffer;
+struct _sample_buffer {
+	volatile unsigned int head; // only written by the thread
+	volatile unsigned int tail; // only written with the lock held
+	volatile bool done; // the thread has exited
+	double left;
+	unsigned int seed;
+	sample_buffer *next;
+	sample samples[SAMPLE_RING];
+};
+
+static int sample_rate = 0;
+static sample_buffer *sample_buffers = NULL;
+
 int hl_internal_capture_stack( void **stack, int size );
+uchar *hl_resolve_symbol( void *addr, uchar *out, int *outSize );
+
+static unsigned int stack_hash( void **stack, int count ) {
+	unsigned int hash = -count;
+	int i;
+	for(i=0;i<count;i++)
+		hash = (hash * 31) + (((unsigned int)(int_val)stack[i]) >> 1);
+	return hash;
+}
 
 static bucket *bucket_find_insert( bucket_list *data, unsigned int hash, void **stack, int count ) {
 	int min = 0, mid;
@@ -136,7 +181,7 @@ static void init_lock() {
 }
 
 static bucket *fetch_bucket( bucket_kind kind ) {
-	int count, i;
+	int count;
 	unsigned int hash;
 	hl_thread_info *tinf = hl_get_thread();
 	bucket_list *data = &all_data[kind];
@@ -144,9 +189,7 @@ static bucket *fetch_bucket( bucket_kind kind ) {
 	if( track_lock == NULL ) init_lock();
 	count = hl_internal_capture_stack(tinf->exc_stack_trace,track_depth);
 	if( count > max_depth ) max_depth = count;
-	hash = -count;
-	for(i=0;i<count;i++)
-		hash = (hash * 31) + (((unsigned int)(int_val)tinf->exc_stack_trace[i]) >> 1);
+	hash = stack_hash(tinf->exc_stack_trace, count);
 	// look for bucket
 	hl_mutex_acquire(track_lock);
 	if( hash == data->prev_hash && data->prev_b ) {
@@ -154,20 +197,115 @@ static bucket *fetch_bucket( bucket_kind kind ) {
 	} else if( hash == data->prev_hash2 && data->prev_b2 ) {
 		b = data->prev_b2;
 	} else {
+		int prev_count = data->bcount;
 		b = bucket_find_insert(data, hash, tinf->exc_stack_trace, count);
 		data->prev_hash2 = data->prev_hash;
-		data->prev_b2 = data->prev_b;
+		// an insert moves the buckets
+		data->prev_b2 = data->bcount == prev_count ? data->prev_b : NULL;
 		data->prev_hash = hash;
 		data->prev_b = b;
 	}
 	return b;
 }
 
+// xorshift, the next sample is after -ln(u) * rate bytes with u uniform in ]0,1]
+static double sample_next( sample_buffer *s ) {
+	double u;
+	s->seed ^= s->seed << 13;
+	s->seed ^= s->seed >> 17;
+	s->seed ^= s->seed << 5;
+	u = ((s->seed >> 8) + 1) / 16777216.;
+	return -log(u) * sample_rate;
+}
+
+static sample_buffer *sample_buffer_alloc( hl_thread_info *tinf ) {
+	sample_buffer *s = (sample_buffer*)malloc(sizeof(sample_buffer));
+	if( s == NULL ) return NULL;
+	memset(s, 0, sizeof(sample_buffer));
+	s->seed = ((unsigned int)tinf->thread_id * 2654435761u) ^ (unsigned int)(int_val)s;
+	if( s->seed == 0 ) s->seed = 1;
+	s->left = sample_next(s);
+	if( track_lock == NULL ) init_lock();
+	hl_mutex_acquire(track_lock);
+	s->next = sample_buffers;
+	sample_buffers = s;
+	hl_mutex_release(track_lock);
+	tinf->track_local = s;
+	return s;
+}
+
+// merge the pending samples into the buckets, with the lock held
+static void sample_flush( sample_buffer *s ) {
+	bucket_list *data = &all_data[KALLOC];
+	unsigned int tail = s->tail, head = s->head;
+	SAMPLE_FENCE();
+	if( tail == head ) return;
+	while( tail != head ) {
+		sample *e = s->samples + (tail % SAMPLE_RING);
+		bucket *b = bucket_find_insert(data, stack_hash(e->stack, e->count), e->stack, e->count);
+		b->t = e->t;
+		b->hit_count++;
+		b->info += e->size;
+		b->bytes += e->weight;
+		tail++;
+	}
+	SAMPLE_FENCE();
+	s->tail = tail;
+	// the inserts moved the buckets
+	data->prev_b = NULL;
+	data->prev_b2 = NULL;
+}
+
+static void sample_flush_all() {
+	sample_buffer **prev = &sample_buffers;
+	while( *prev ) {
+		sample_buffer *s = *prev;
+		bool done = s->done;
+		sample_flush(s);
+		if( done ) {
+			*prev = s->next;
+			free(s);
+		} else
+			prev = &s->next;
+	}
+}
+
+static void sample_alloc( hl_type *t, int size ) {
+	hl_thread_info *tinf = hl_get_thread();
+	sample_buffer *s = (sample_buffer*)tinf->track_local;
+	sample *e;
+	if( size <= 0 ) return;
+	if( s == NULL && (s = sample_buffer_alloc(tinf)) == NULL ) return;
+	s->left -= size;
+	if( s->left > 0 ) return;
+	s->left = sample_next(s);
+	if( s->head - s->tail == SAMPLE_RING ) {
+		hl_mutex_acquire(track_lock);
+		sample_flush(s);
+		hl_mutex_release(track_lock);
+	}
+	e = s->samples + (s->head % SAMPLE_RING);
+	e->t = t;
+	e->size = size;
+	// probability for this allocation to be sampled is 1 - exp(-size/rate)
+	e->weight = size / (1 - exp(-(double)size / sample_rate));
+	e->count = hl_internal_capture_stack(e->stack, track_depth < SAMPLE_DEPTH ? track_depth : SAMPLE_DEPTH);
+	if( e->count > max_depth ) max_depth = e->count;
+	SAMPLE_FENCE();
+	s->head++;
+}
+
 static void on_alloc( hl_type *t, int size, int flags, void *ptr ) {
-	bucket *b = fetch_bucket(KALLOC);
+	bucket *b;
+	if( sample_rate ) {
+		sample_alloc(t, size);
+		return;
+	}
+	b = fetch_bucket(KALLOC);
 	b->t = t;
 	b->hit_count++;
 	b->info += size;
+	b->bytes += size;
 	hl_mutex_release(track_lock);
 }
 
@@ -200,6 +338,9 @@ HL_PRIM void hl_track_init() {
 	char *env = getenv("HL_TRACK");
 	if( env )
 		hl_track.flags = atoi(env);
+	env = getenv("HL_TRACK_SAMPLE");
+	if( env )
+		sample_rate = atoi(env);
 	hl_track.on_alloc = on_alloc;
 	hl_track.on_cast = on_cast;
 	hl_track.on_dynfield = on_dynfield;
@@ -220,6 +361,11 @@ HL_PRIM void hl_track_lock( bool lock ) {
 HL_PRIM int hl_track_count( int *depth ) {
 	int value = 0;
 	int i;
+	if( sample_buffers ) {
+		hl_mutex_acquire(track_lock);
+		sample_flush_all();
+		hl_mutex_release(track_lock);
+	}
 	for(i=0;i<_KLAST;i++)
 		value += all_data[i].bcount;
 	*depth = max_depth;
@@ -285,8 +431,63 @@ HL_PRIM void hl_track_set_bits( int flags, bool thread ) {
 
 HL_PRIM void hl_track_reset() {
 	int i;
-	for(i=0;i<_KLAST;i++)
+	if( sample_buffers ) {
+		hl_mutex_acquire(track_lock);
+		sample_flush_all();
+		hl_mutex_release(track_lock);
+	}
+	for(i=0;i<_KLAST;i++) {
 		all_data[i].bcount = 0;
+		all_data[i].prev_b = NULL;
+		all_data[i].prev_b2 = NULL;
+	}
+}
+
+// record one allocation every <bytes> allocated per thread on average, or all of them if 0
+HL_PRIM void hl_track_set_sampling( int bytes ) {
+	sample_rate = bytes < 0 ? 0 : bytes;
+}
+
+void hl_track_thread_exit( hl_thread_info *t ) {
+	sample_buffer *s = (sample_buffer*)t->track_local;
+	if( s ) s->done = true;
+	t->track_local = NULL;
+}
+
+// write the allocation sites in the collapsed stacks format : the frames from the outermost
+// separated by semicolons, followed by the allocated bytes
+HL_PRIM bool hl_track_dump_allocs( vbyte *file ) {
+	hl_thread_info *tinf = hl_get_thread();
+	bucket_list *data = &all_data[KALLOC];
+	int flags = tinf->flags;
+	FILE *f;
+	int i, k;
+	f = fopen((char*)file,"wb");
+	if( f == NULL ) return false;
+	if( track_lock == NULL ) init_lock();
+	tinf->flags &= ~(HL_TRACK_ALLOC<<HL_TREAD_TRACK_SHIFT);
+	hl_mutex_acquire(track_lock);
+	sample_flush_all();
+	for(i=0;i<data->bcount;i++) {
+		bucket *b = data->buckets + i;
+		if( b->bytes <= 0 ) continue;
+		for(k=b->stack_count-1;k>=0;k--) {
+			uchar sym[512];
+			int size = 512;
+			uchar *str = hl_resolve_symbol(b->stack[k], sym, &size);
+			if( k < b->stack_count - 1 ) fputc(';',f);
+			if( str )
+				fputs(hl_to_utf8(str),f);
+			else
+				fprintf(f,"@0x%llX",(unsigned long long)(int_val)b->stack[k]);
+		}
+		if( b->stack_count == 0 ) fputs("?",f);
+		fprintf(f," %.0f\n",b->bytes);
+	}
+	hl_mutex_release(track_lock);
+	tinf->flags = flags;
+	fclose(f);
+	return true;
 }
 
 DEFINE_PRIM(_VOID, track_init, _NO_ARG);
@@ -297,3 +498,5 @@ DEFINE_PRIM(_VOID, track_set_depth, _I32);
 DEFINE_PRIM(_I32, track_get_bits, _BOOL);
 DEFINE_PRIM(_VOID, track_set_bits, _I32 _BOOL);
 DEFINE_PRIM(_VOID, track_reset, _NO_ARG);
+DEFINE_PRIM(_VOID, track_set_sampling, _I32);
+DEFINE_PRIM(_BOOL, track_dump_allocs, _BYTES);